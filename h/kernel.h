@@ -15,6 +15,10 @@ typedef unsigned long u64;
 
 #define ASM(__inline_asm) __asm__ __volatile__ (__inline_asm)
 
+// Free running machine timer, counts at 10MHz on qemu virt
+#define CLINT_MTIME 0x200BFF8ULL
+#define CLINT_TICKS_PER_US 10
+
 // #define DEBUG
 
 void __print_u64(u64);
@@ -24,6 +28,9 @@ void __print_h32(u32);
 void __print_str(char *str);
 void __print_mem(char *msg, u64 mem);
 
+u64 __bit_first_set(u64 mask);
+u64 __bit_last_set(u64 mask);
+
 #ifdef DEBUG
 #define __debug_u64(u64) __print_u64(u64)
 #define __debug_i32(i32) __print_i32(i32)
@@ -84,6 +91,16 @@ struct __context_t
 
 typedef struct __context_t * context_t;
 
+struct __boot_stats_t
+{
+    u64 boot_time;
+    u64 mem_init_time;
+    u64 mem_init_index_writes;
+    u64 heap_blocks;
+};
+
+u64 __time_now();
+
 void __stop();
 void __panic(char *msg);
 
@@ -3,10 +3,134 @@
 
 #include "../lib/hw.h"
 #include "../h/kernel.h"
+#include "../h/list.h"
+
+// Free runs are segregated by floor(log2(size in blocks))
+#define MEM_CLASS_COUNT 32
+
+// Bytes set aside for kernel objects, at most half of the heap
+#ifndef MEM_KERNEL_HEAP_SIZE
+#define MEM_KERNEL_HEAP_SIZE 0x400000
+#endif
+
+// Allocations of at least this many blocks are carved from the top of the heap, smaller ones from the bottom
+#ifndef MEM_LARGE_THRESHOLD
+#define MEM_LARGE_THRESHOLD 32
+#endif
+
+// Runs looked at per class when looking for the lowest or highest fit, bounds every allocation
+#ifndef MEM_PLACEMENT_SCAN
+#define MEM_PLACEMENT_SCAN 8
+#endif
+
+enum FREE_ERRORS
+{
+    FREE_OUT_OF_HEAP = -1,
+    FREE_NOT_BLOCK_ALLIGNED = -2,
+    FREE_NOT_ALLOCED = -3,
+    FREE_NOT_START_OF_ALLOC = -4,
+};
+
+// Zeroed runs of 1, 2, 4 ... blocks kept ready for calloc, this many of each size
+#ifndef MEM_ZERO_POOL_CLASSES
+#define MEM_ZERO_POOL_CLASSES 8
+#endif
+
+#ifndef MEM_ZERO_POOL_DEPTH
+#define MEM_ZERO_POOL_DEPTH 4
+#endif
+
+// Heaps mem_stats can report on
+#define MEM_HEAP_USER 0
+#define MEM_HEAP_KERNEL 1
+
+struct __mem_stats_t
+{
+    u64 bytes_total;
+    u64 bytes_in_use;
+    u64 bytes_peak;
+    u64 largest_free_run;
+    // Zeroed runs held for calloc, neither in use nor part of a free run
+    u64 bytes_pooled;
+
+    // Free runs per class, class i holds runs of [2^i, 2^(i+1)) blocks
+    u64 free_runs[MEM_CLASS_COUNT];
+
+    u64 alloc_count;
+    u64 free_count;
+    u64 failed_alloc_count;
+};
+
+// Allocator instance over [start, end), its index takes the first blocks of the range
+struct __mem_heap_t
+{
+    char *name;
+    const void *start;
+    const void *end;
+
+#ifdef MEM_COMPACT_INDEX
+    // One bit per block in each map, a set start bit marks the first block of a run,
+    // alloc bits are only meaningful on the first and last block of a run.
+    // Free runs keep their size in-band next to the free list node, allocated runs end at the next start bit
+    u64 *run_starts;
+    u64 *run_allocs;
+#else
+    i32 *index;
+#endif
+
+    u64 n_blocks;
+    u64 index_len_in_blocks;
+
+    // Entries in [start, end) were never written and hold garbage, everything else is valid
+    u64 untouched_start;
+    u64 untouched_end;
+
+    // Free list node lives in the first block of every free run
+    list_t *free_runs[MEM_CLASS_COUNT];
+    u64 free_run_count[MEM_CLASS_COUNT];
+    u64 free_classes;
+
+    // Singly linked through the first word, which is cleared again when a run is handed out
+    u64 *zero_pool[MEM_ZERO_POOL_CLASSES];
+    u64 zero_pool_count[MEM_ZERO_POOL_CLASSES];
+    u64 zero_pool_blocks;
+    // Run being zeroed one block per fill step, it joins its class once zero_fill_next reaches its size
+    u64 *zero_fill;
+    u64 zero_fill_class;
+    u64 zero_fill_next;
+
+    // Starts at MEM_LARGE_THRESHOLD, anything above the heap's size places every allocation from the bottom
+    u64 large_threshold;
+
+    u64 blocks_in_use;
+    u64 blocks_peak;
+    u64 alloc_count;
+    u64 free_count;
+    u64 failed_alloc_count;
+};
+
+// Kernel objects live in kernel_heap, everything user code asks for in user_heap
+extern struct __mem_heap_t kernel_heap;
+extern struct __mem_heap_t user_heap;
+
+// Index entries written since __mem_init, one per bit with MEM_COMPACT_INDEX
+extern u64 mem_index_writes;
 
 void __mem_init();
-void *__mem_alloc(size_t nblocks);
-int __mem_free(void *ptr);
-void __mem_print();
+void __mem_heap_init(struct __mem_heap_t *heap, char *name, const void *start, const void *end);
+void *__mem_alloc(struct __mem_heap_t *heap, size_t nblocks);
+void *__mem_alloc_aligned(struct __mem_heap_t *heap, size_t nblocks, size_t align_blocks);
+int __mem_free(struct __mem_heap_t *heap, void *ptr);
+i64 __mem_alloc_entry(struct __mem_heap_t *heap, void *ptr);
+size_t __mem_size(struct __mem_heap_t *heap, void *ptr);
+void *__mem_calloc(struct __mem_heap_t *heap, size_t nblocks);
+int __mem_zero_pool_fill(struct __mem_heap_t *heap);
+int __mem_zero_pool_drain(struct __mem_heap_t *heap);
+void *__mem_realloc(struct __mem_heap_t *heap, void *ptr, size_t nblocks);
+size_t __mem_alloc_batch(struct __mem_heap_t *heap, size_t count, size_t nblocks, void **out);
+size_t __mem_free_batch(struct __mem_heap_t *heap, void **ptrs, size_t count);
+void __mem_print(struct __mem_heap_t *heap);
+void __mem_stats(struct __mem_heap_t *heap, struct __mem_stats_t *stats);
+size_t __mem_set_large_threshold(struct __mem_heap_t *heap, size_t nblocks);
 
 #endif //MEM_HEADER
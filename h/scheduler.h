@@ -6,30 +6,54 @@
 #include "../h/semaphore.h"
 #include "../h/list.h"
 
-struct __sleeping_thread_t
-{
-    thread_t thread;
-    sem_t semaphore;
-    time_t delta;
-    list_t list_node;
-};
+// Hierarchical timing wheel, a slot on one level spans a whole turn of the level below
+#define SCHEDULER_WHEEL_LEVELS 4
+#define SCHEDULER_WHEEL_BITS 6
+#define SCHEDULER_WHEEL_SLOTS (1 << SCHEDULER_WHEEL_BITS)
+
+// With SCHEDULER_MLFQ every ready thread is lifted back to the top level this often, in ticks
+#define SCHEDULER_BOOST_PERIOD 100
+
+// Fixed point scale of EDF densities, admission keeps the sum of budget / deadline at or below one
+#define SCHEDULER_EDF_DENSITY_ONE (1ULL << 20)
 
 struct __scheduler_t
 {
     u64 user_thread_count;
-    list_t *ready_threads;
-    list_t *sleeping_threads;
+    // One round robin queue per priority, bit i of ready_levels is set while ready_threads[i] is not empty
+    list_t *ready_threads[THREAD_PRIORITY_LEVELS];
+    u64 ready_levels;
+    // EDF threads sorted by absolute deadline, they all run ahead of the priority levels
+    list_t *edf_ready;
+    u64 edf_density;
+#ifdef SCHEDULER_MLFQ
+    time_t boost_left;
+#endif
+    time_t ticks;
+    u64 sleeping_count;
+    list_t *timer_wheel[SCHEDULER_WHEEL_LEVELS][SCHEDULER_WHEEL_SLOTS];
     thread_t thread_current;
     thread_t kernel_main;
+    // Runs when nothing else is ready, never sits in a run queue
+    thread_t idle;
+#ifdef SCHEDULER_TICKLESS
+    u32 tick_stopped;
+#endif
 };
 
 typedef struct __scheduler_t * scheduler_t;
-typedef struct __sleeping_thread_t * sleeping_thread_t;
 
 void __scheduler_init(thread_t kernel_main);
+void __scheduler_set_idle(thread_t idle);
+void __scheduler_idle_loop(void *arg);
 void __scheduler_push(thread_t new_thread);
 thread_t __scheduler_current();
 thread_t __scheduler_next();
+int __scheduler_preempts(thread_t thread);
+int __scheduler_set_priority(thread_t thread, u32 priority);
+void __scheduler_set_level(thread_t thread, u32 level);
+void __scheduler_demote(thread_t thread);
+void __scheduler_wake(thread_t thread);
 void __scheduler_user_thread_increment();
 void __scheduler_user_thread_decrement();
 u64 __scheduler_user_thread_count();
@@ -40,4 +64,12 @@ void __scheduler_timeout(thread_t thread, time_t time, sem_t semaphore);
 void __scheduler_remove_timeout(thread_t thread);
 void __scheduler_tick();
 
+int __scheduler_period_start(thread_t thread, time_t period);
+int __scheduler_period_wait(thread_t thread);
+int __scheduler_period_stop(thread_t thread);
+
+int __scheduler_edf_start(thread_t thread, time_t period, time_t budget, time_t deadline);
+int __scheduler_edf_charge(thread_t thread);
+void __scheduler_edf_leave(thread_t thread);
+
 #endif //SCHEDULER_HEADER
@@ -5,17 +5,26 @@
 #include "../h/kernel.h"
 #include "../h/thread.h"
 #include "../h/mem.h"
+#include "../h/slab.h"
 
+// Waiting threads are kept most urgent first, EDF threads ahead of every priority level
 struct __sem_t
 {
     i32 val;
     i32 init;
     list_t *waiting_threads;
+
+    // Mutexes are binary semaphores with an owner that inherits the level of its most urgent waiter
+    u32 mutex;
+    thread_t owner;
+    list_t owner_node;
 };
 
 typedef struct __sem_t * sem_t;
 
+void __sem_init();
 int __sem_open(sem_t *handle, u32 init);
+int __sem_open_mutex(sem_t *handle);
 int __sem_close(sem_t handle);
 int __sem_wait(sem_t handle);
 int __sem_unblock_thread(sem_t handle);
@@ -24,6 +33,9 @@ int __sem_timed_wait(sem_t handle, time_t timeout);
 int __sem_trywait(sem_t handle);
 void __sem_delete(sem_t handle);
 void __sem_remove_thread(sem_t handle, thread_t thread);
+void __sem_inherit_update(thread_t thread, u32 own_level);
+u32 __sem_own_level(thread_t thread);
+void __sem_abandon(thread_t thread);
 void __sem_first_print();
 void __sem_all_print();
 
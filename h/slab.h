@@ -0,0 +1,48 @@
+#ifndef SLAB_HEADER
+#define SLAB_HEADER
+
+#include "../lib/hw.h"
+#include "../h/kernel.h"
+#include "../h/list.h"
+#include "../h/mem.h"
+
+// Every slab is one run of this many heap blocks, carved into equal objects.
+// Slabs start at a multiple of their size from the kernel heap start, masking an object pointer gives its slab
+#define SLAB_BLOCKS 16
+#define SLAB_BYTES (SLAB_BLOCKS * MEM_BLOCK_SIZE)
+
+// Second word of every free object, a live one holding exactly this is taken for a double free
+#define SLAB_FREE_MAGIC 0x45455246424C4153ULL
+
+// Sits at the start of every slab, objects follow it
+struct __slab_t
+{
+    list_t slab_node;
+    struct __slab_cache_t *cache;
+};
+
+struct __slab_cache_t
+{
+    char *name;
+    u64 object_size;
+    u64 objects_per_slab;
+
+    // Intrusive, the first word of a free object points to the next one
+    void *free_objects;
+    list_t *slabs;
+
+    u64 slab_count;
+    u64 objects_in_use;
+    list_t cache_node;
+};
+
+typedef struct __slab_cache_t * slab_cache_t;
+
+void __slab_init(slab_cache_t cache, char *name, u64 object_size);
+void *__slab_alloc(slab_cache_t cache);
+int __slab_check(slab_cache_t cache, void *object);
+int __slab_free(slab_cache_t cache, void *object);
+void __slab_print(slab_cache_t cache);
+void __slab_print_all();
+
+#endif //SLAB_HEADER
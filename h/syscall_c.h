@@ -9,12 +9,41 @@ extern "C" {
 #include "../h/kernel.h"
 #include "../h/thread.h"
 #include "../h/semaphore.h"
+#include "../h/mem.h"
 
 void putc(char c);
 char getc();
 void *mem_alloc(size_t nbytes);
+void *mem_calloc(size_t count, size_t size);
 int mem_free(void *ptr);
+void *mem_realloc(void *ptr, size_t nbytes);
+int mem_alloc_batch(size_t count, size_t size, void *out[]);
+int mem_free_batch(void *ptrs[], size_t count);
+// heap is MEM_HEAP_USER or MEM_HEAP_KERNEL
+int mem_stats(struct __mem_stats_t *stats, unsigned int heap);
+// Bytes a running thread allocated and has not freed yet, small objects count their slot. Null for the caller
+size_t mem_live_bytes(thread_t handle);
+// User heap allocations of at least nblocks are placed from the top, returns the old threshold
+size_t mem_large_threshold(size_t nblocks);
 int thread_create(thread_t *handle, void(* start_f)(void *), void *arg);
+int thread_create_ex(thread_t *handle, void(* start_f)(void *), void *arg, struct __thread_attr_t *attr);
+// Deepest stack use of a running thread in bytes, null for the caller, -1 unless built with THREAD_STACK_PAINT
+int thread_stack_usage(thread_t handle);
+// 0 up to THREAD_PRIORITY_LEVELS - 1, higher runs first, null handle for the caller
+int thread_set_priority(thread_t handle, unsigned int priority);
+int thread_get_priority(thread_t handle);
+// Makes the caller periodic, releases fall on exact multiples of period from now
+int thread_period_start(time_t period);
+// Sleeps until the next release, -1 once the thread was stopped
+int thread_period_wait();
+// Works before the thread started its period too, the start then returns -1
+int thread_period_stop(thread_t handle);
+// Releases skipped because an activation ran past them
+int thread_period_overruns(thread_t handle);
+// Like thread_period_start but scheduled by earliest deadline with budget ticks per period, -2 if the task set would not fit
+int thread_edf_start(time_t period, time_t budget, time_t deadline);
+// Jobs that ran out of budget or finished past their deadline
+int thread_edf_misses(thread_t handle);
 int thread_exit();
 void thread_dispatch();
 
@@ -24,9 +53,17 @@ int sem_wait(sem_t handle);
 int sem_signal(sem_t handle);
 int sem_timed_wait(sem_t handle, time_t timeout);
 int sem_trywait(sem_t handle);
+// Binary semaphore owned by the thread that took it, locked with sem_wait and released only by the owner with sem_signal.
+// The owner inherits the priority of its most urgent waiter
+int mutex_open(sem_t *handle);
+// Locks the mutex in *handle, opening it first while *handle is still null. Threads may race on the first call,
+// all of them end up on the same mutex. -1 if the kernel has no room for it
+int mutex_lock_lazy(sem_t *handle);
 
 int time_sleep(time_t time);
 
+int boot_stats(struct __boot_stats_t *stats);
+
 #endif //SYSCALL_C_HEADER
 
 #ifdef __cplusplus
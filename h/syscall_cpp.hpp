@@ -2,31 +2,47 @@
 #define SYSCALL_CPP_HEADER
 
 #include "../h/syscall_c.h"
+#include "../h/user_mem.h"
 
 void *operator new(size_t);
 void *operator new[](size_t);
 void operator delete(void *) noexcept;
 void operator delete[](void *) noexcept;
 
+// Placement form, there is no <new> to take it from
+inline void *operator new(size_t, void *ptr) noexcept { return ptr; }
+
 class Thread
 {
 public:
     Thread(void(* body)(void *), void *arg);
+    Thread(void(* body)(void *), void *arg, const struct __thread_attr_t &attr);
     virtual ~Thread();
 
     int start();
 
+    // Only while the thread runs, see thread_stack_usage and mem_live_bytes
+    int stackUsage();
+    size_t liveBytes();
+    // Before start sets the priority the thread is created with
+    int setPriority(unsigned priority);
+    int getPriority();
+
     static void dispatch();
     static int sleep(time_t);
 
 protected:
     Thread();
+    explicit Thread(const struct __thread_attr_t &attr);
     virtual void run() {};
 
 private:
     thread_t myHandle;
     void (* body)(void *);
     void *arg;
+    struct __thread_attr_t attr;
+
+    friend class PeriodicThread;
 };
 
 class Semaphore
@@ -44,19 +60,279 @@ private:
     sem_t myHandle;
 };
 
+class Mutex
+{
+public:
+    Mutex();
+    virtual ~Mutex();
+
+    int lock();
+    int unlock();
+
+private:
+    sem_t myHandle;
+};
+
 class PeriodicThread : public Thread
 {
 public:
+    // Only while the thread runs, see thread_period_stop and thread_period_overruns
     void terminate();
+    int overruns();
+    int deadlineMisses();
 
 protected:
     PeriodicThread(time_t period);
+    // Runs in the EDF class, see thread_edf_start
+    PeriodicThread(time_t period, time_t budget, time_t deadline);
     virtual void periodicActivation() {}
 
 private:
+    void run() override;
+
     time_t period;
+    time_t budget;
+    time_t deadline;
 };
 
+class Memory
+{
+public:
+    static void *calloc(size_t count, size_t size);
+    static void *realloc(void *ptr, size_t size);
+    static int allocBatch(size_t count, size_t size, void *out[]);
+    static int freeBatch(void *ptrs[], size_t count);
+    static int stats(struct __mem_stats_t *stats, unsigned heap = MEM_HEAP_USER);
+    static size_t liveBytes();
+};
+
+// Bump allocator over chunks taken with mem_alloc, everything it handed out is released at once.
+// Destructors of objects built in it are not run
+class Arena
+{
+public:
+    // What mem_alloc and the kernel put in front of a chunk, chunks are sized so that together they fill whole blocks
+    static const size_t chunkOverhead = sizeof(struct __user_mem_header_t) + sizeof(struct __thread_mem_header_t);
+    static const size_t defaultChunkSize = 64 * MEM_BLOCK_SIZE - chunkOverhead;
+
+    explicit Arena(size_t chunkSize = defaultChunkSize);
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // align has to be a power of two
+    void *alloc(size_t size, size_t align = sizeof(u64))
+    {
+        u64 start = ((u64)current + align - 1) & ~(u64)(align - 1);
+
+        // An empty arena has no chunk to hand out of, not even for size 0, and start may have wrapped around
+        if(start < (u64)current || start >= (u64)end || size > (u64)end - start)
+            return grow(size, align);
+
+        current = (char *)(start + size);
+        return (void *)start;
+    }
+
+    template<typename T, typename... Args>
+    T *create(Args &&... args)
+    {
+        void *ptr = alloc(sizeof(T), alignof(T));
+        return ptr ? new(ptr) T(static_cast<Args &&>(args)...) : 0;
+    }
+
+    // Keeps the first chunk for reuse and frees the rest
+    void reset();
+
+    size_t allocated() const { return chunkBytes; }
+
+private:
+    struct Chunk
+    {
+        Chunk *next;
+        size_t size;
+    };
+
+    void *grow(size_t size, size_t align);
+
+    Chunk *chunks;
+    char *current;
+    char *end;
+    size_t chunkSize;
+    size_t chunkBytes;
+};
+
+// Slots for T carved out of mem_alloc chunks, freed slots go back on an intrusive list.
+// It is built at compile time and has no destructor so it can be a static member, as nothing runs global constructors.
+// Its mutex is opened on first use, release() hands the chunks and the mutex back
+template<typename T>
+class ObjectPool
+{
+public:
+    constexpr explicit ObjectPool(size_t objectsPerChunk = 32, bool growable = true)
+        : freeSlots(0), chunks(0), objectsPerChunk(objectsPerChunk), growable(growable), mutex(0), inUse(0) {}
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    void *alloc()
+    {
+        if(mutex_lock_lazy(&mutex))
+            return 0;
+
+        if(freeSlots == 0 && !grow())
+        {
+            unlock();
+            return 0;
+        }
+
+        Slot *slot = freeSlots;
+        freeSlots = slot->next;
+        inUse++;
+
+        unlock();
+        return slot;
+    }
+
+    void free(void *ptr)
+    {
+        if(ptr == 0)
+            return;
+
+        // A slot in use means the mutex is open
+        mutex_lock_lazy(&mutex);
+
+        Slot *slot = (Slot *)ptr;
+        slot->next = freeSlots;
+        freeSlots = slot;
+        inUse--;
+
+        unlock();
+    }
+
+    template<typename... Args>
+    T *create(Args &&... args)
+    {
+        void *ptr = alloc();
+        return ptr ? new(ptr) T(static_cast<Args &&>(args)...) : 0;
+    }
+
+    void destroy(T *object)
+    {
+        if(object == 0)
+            return;
+
+        object->~T();
+        free(object);
+    }
+
+    // Only once every object is back in the pool, -1 otherwise. Nobody else may use the pool while it runs
+    int release()
+    {
+        if(mutex_lock_lazy(&mutex))
+            return -1;
+
+        if(inUse)
+        {
+            unlock();
+            return -1;
+        }
+
+        while(chunks)
+        {
+            Chunk *next = chunks->next;
+            mem_free(chunks);
+            chunks = next;
+        }
+
+        freeSlots = 0;
+
+        sem_t handle = mutex;
+        mutex = 0;
+
+        sem_signal(handle);
+        sem_close(handle);
+        return 0;
+    }
+
+    size_t objectsInUse() const { return inUse; }
+
+private:
+    union Slot
+    {
+        Slot *next;
+        alignas(T) char storage[sizeof(T)];
+    };
+
+    struct Chunk
+    {
+        Chunk *next;
+    };
+
+    static constexpr size_t slotsOffset = (sizeof(Chunk) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+
+    // A pool that can not grow keeps the first chunk it gets
+    bool grow()
+    {
+        if(chunks && !growable)
+            return false;
+
+        Chunk *chunk = (Chunk *)mem_alloc(slotsOffset + objectsPerChunk * sizeof(Slot));
+        if(chunk == 0)
+            return false;
+
+        chunk->next = chunks;
+        chunks = chunk;
+
+        Slot *slots = (Slot *)((char *)chunk + slotsOffset);
+        for(size_t i = objectsPerChunk; i > 0; i--)
+        {
+            slots[i - 1].next = freeSlots;
+            freeSlots = &slots[i - 1];
+        }
+
+        return true;
+    }
+
+    void unlock()
+    {
+        sem_signal(mutex);
+    }
+
+    Slot *freeSlots;
+    Chunk *chunks;
+    size_t objectsPerChunk;
+    bool growable;
+    sem_t mutex;
+    size_t inUse;
+};
+
+// Opt in through class Message : public PoolAllocated<Message>, new and delete of Message then use one shared pool.
+// Subclasses of a different size fall back to the global operators. new gives null when the pool can not grow,
+// it has to be noexcept for the new expression to check for that before running the constructor
+template<typename T>
+class PoolAllocated
+{
+public:
+    static void *operator new(size_t size) noexcept
+    {
+        return size == sizeof(T) ? pool.alloc() : ::operator new(size);
+    }
+
+    static void operator delete(void *ptr, size_t size) noexcept
+    {
+        if(size == sizeof(T))
+            pool.free(ptr);
+        else
+            ::operator delete(ptr);
+    }
+
+    static ObjectPool<T> pool;
+};
+
+template<typename T>
+ObjectPool<T> PoolAllocated<T>::pool;
+
 class Console
 {
 public:
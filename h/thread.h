@@ -4,6 +4,19 @@
 #include "../lib/hw.h"
 #include "../h/kernel.h"
 #include "../h/list.h"
+#include "../h/slab.h"
+
+// Room for the trap frame and a few calls
+#define THREAD_MIN_STACK_SIZE 512
+
+// With THREAD_STACK_PAINT unused stack words hold this pattern, the lowest one doubles as an overflow canary
+#define THREAD_STACK_PAINT_WORD 0x4B43545320544E50ULL
+
+// Scheduling levels, 0 is the lowest and the default
+#define THREAD_PRIORITY_LEVELS 8
+
+// Exited threads keep their stack and are handed out again, up to this many
+#define THREAD_RECYCLE_MAX 16
 
 enum EXEC_MODE
 {
@@ -11,6 +24,52 @@ enum EXEC_MODE
     EXEC_MODE_KERNEL
 };
 
+// Memory the thread still owns is freed when it exits instead of being handed over as shared
+#define THREAD_ATTR_RECLAIM 0x1
+
+// Zeroed fields fall back to DEFAULT_STACK_SIZE and DEFAULT_TIME_SLICE
+struct __thread_attr_t
+{
+    size_t stack_size;
+    time_t time_slice;
+    u32 priority;
+    u32 flags;
+};
+
+struct __sem_t;
+
+// Pending timeout of a sleep or a timed wait, a thread has at most one and slot is null while it is not armed
+struct __thread_timer_t
+{
+    struct __sem_t *semaphore;
+    time_t expires;
+    list_t **slot;
+    list_t list_node;
+};
+
+// Releases fall on exact multiples of period after the one thread_period_start recorded
+struct __thread_period_t
+{
+    time_t period;
+    time_t release;
+    u64 overruns;
+    u32 waiting;
+    u32 terminated;
+};
+
+// Earliest deadline first class, budget is zero for threads outside it
+struct __thread_edf_t
+{
+    time_t budget;
+    time_t relative_deadline;
+    time_t deadline;
+    time_t budget_left;
+    u64 density;
+    u64 misses;
+    // A job that ran out of budget finishes on the next release's budget, that release gets no job of its own
+    u32 spilled;
+};
+
 struct __thread_t
 {
     u64 sp;
@@ -20,13 +79,75 @@ struct __thread_t
 
     time_t time_left;
     list_t list_node;
+
+    u64 stack_size;
+    // Set when the kernel allocated the stack, only those are recycled or freed
+    u32 stack_owned;
+    time_t time_slice;
+    u32 priority;
+    u32 flags;
+
+    struct __thread_timer_t timer;
+    struct __thread_period_t periodic;
+    struct __thread_edf_t edf;
+
+    // Run queue the thread goes to, equal to priority unless built with SCHEDULER_MLFQ
+    u32 level;
+    // Set while the thread sits in a run queue
+    u32 ready;
+
+    // Priority inheritance, while boosted level is inherited from a mutex waiter and base_level is the thread's own
+    u32 base_level;
+    u32 boosted;
+    list_t *held_mutexes;
+    struct __sem_t *blocked_on;
+
+    // Allocations made through the memory syscalls, owned_bytes counts their blocks less the headers
+    list_t *owned_mem;
+    u64 owned_bytes;
+    // Registered by the user allocator, null until the thread makes its first small allocation
+    struct __thread_mem_slots_t *mem_slots;
 };
 
 typedef struct __thread_t * thread_t;
 
-void __thread_wrapper(void(* start_f)(void *), void *arg);
-int __thread_create(thread_t *handle, void(* start_f)(void *), void *arg, void *stack_space, enum EXEC_MODE mode);
+#define THREAD_MEM_MAGIC 0x4E574F4D454D5754ULL
+
+// Starts the first block of every allocation handed out by the memory syscalls, owner is null for shared memory
+struct __thread_mem_header_t
+{
+    list_t owner_node;
+    thread_t owner;
+    u64 magic;
+};
+
+// Lives in user memory, the user allocator keeps it up to date as it carves chunks and hands out slots.
+// Live bytes of the thread count the slots in place of the chunks they came from
+struct __thread_mem_slots_t
+{
+    u64 chunk_bytes;
+    u64 slot_bytes;
+};
+
+// Anything bigger would wrap around once the header and the rounding up to whole blocks are added
+#define THREAD_MEM_MAX_BYTES ((size_t)-1 - sizeof(struct __thread_mem_header_t) - MEM_BLOCK_SIZE)
+
+extern struct __slab_cache_t thread_cache;
+
+void __thread_init();
+
+void __thread_wrapper(void(* start_f)(void *), void *arg, u64 flags);
+int __thread_create(thread_t *handle, void(* start_f)(void *), void *arg, void *stack_space, enum EXEC_MODE mode, struct __thread_attr_t *attr);
 void __thread_delete(thread_t thread);
+i64 __thread_stack_high_water(thread_t thread);
+
+void *__thread_mem_alloc(thread_t owner, size_t nbytes);
+void *__thread_mem_calloc(thread_t owner, size_t nbytes);
+int __thread_mem_free(void *ptr);
+void *__thread_mem_realloc(void *ptr, size_t nbytes);
+size_t __thread_mem_alloc_batch(thread_t owner, size_t count, size_t nbytes, void **out);
+size_t __thread_mem_free_batch(void **ptrs, size_t count);
+void __thread_mem_release(thread_t thread);
 void __thread_exit();
 void __thread_dispatch();
 void yield(thread_t thread_old, thread_t thread_new);
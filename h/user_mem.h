@@ -0,0 +1,94 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef USER_MEM_HEADER
+#define USER_MEM_HEADER
+
+#include "../lib/hw.h"
+#include "../h/kernel.h"
+#include "../h/thread.h"
+
+// Slot sizes (header included) are 16, 32, ... 2048 bytes, anything bigger goes straight to the kernel
+#define USER_MEM_CLASS_COUNT 8
+#define USER_MEM_MIN_SLOT 16
+#define USER_MEM_MAX_SLOT (USER_MEM_MIN_SLOT << (USER_MEM_CLASS_COUNT - 1))
+#define USER_MEM_CLASS_LARGE USER_MEM_CLASS_COUNT
+
+// Every thread carves its small slots out of chunks it owns, the first one this many blocks long
+// and each next one twice the last up to USER_MEM_CHUNK_BLOCKS
+#define USER_MEM_CHUNK_MIN_BLOCKS 16
+#define USER_MEM_CHUNK_BLOCKS 256
+
+// Large frees are handed to the kernel this many at a time
+#define USER_MEM_FREE_BATCH 64
+
+#define USER_MEM_MAGIC 0x4D454D55
+#define USER_MEM_FREED 0x45455246
+
+// Set in tp of threads created with THREAD_ATTR_RECLAIM, the rest of tp points to the thread's arena
+#define USER_MEM_TP_RECLAIM 0x1ULL
+
+// chunk_offset counts USER_MEM_MIN_SLOT steps back to the chunk a small slot was carved from
+struct __user_mem_header_t
+{
+    u32 magic;
+    u16 size_class;
+    u16 chunk_offset;
+};
+
+struct __user_mem_arena_t;
+
+// Takes the first USER_MEM_MIN_SLOT bytes of every chunk
+struct __user_mem_chunk_t
+{
+    struct __user_mem_arena_t *arena;
+};
+
+// Small slots of one thread, frees from other threads go back to the arena the slot came from.
+// It lives in the thread's first chunk, the arena of a thread that exits without THREAD_ATTR_RECLAIM is taken over by the next new one
+struct __user_mem_arena_t
+{
+    void *free_slots[USER_MEM_CLASS_COUNT];
+    struct __user_mem_chunk_t *chunk;
+    char *chunk_next;
+    char *chunk_end;
+    u64 chunk_blocks;
+    struct __user_mem_arena_t *next_orphan;
+    // Slots still out count towards the live bytes of the thread holding the arena, whoever carved them
+    struct __thread_mem_slots_t slots;
+};
+
+// Anything bigger would wrap around once the header and the rounding up to whole blocks are added
+#define USER_MEM_MAX_BYTES ((size_t)-1 - sizeof(struct __user_mem_header_t) - MEM_BLOCK_SIZE)
+
+void *user_mem_alloc(size_t nbytes);
+void *user_mem_calloc(size_t nbytes);
+int user_mem_free(void *ptr);
+void *user_mem_realloc(void *ptr, size_t nbytes);
+int user_mem_alloc_batch(size_t count, size_t nbytes, void **out);
+int user_mem_free_batch(void **ptrs, size_t count);
+
+// Called by every thread on its way in and out, flags are the thread's THREAD_ATTR_ flags
+void user_mem_thread_start(u64 flags);
+void user_mem_thread_exit();
+
+// Raw syscalls, every call is a trap into the kernel. The kernel's ownership header shares the first block
+// with the allocation, nbytes is rounded up to whole blocks together with it
+void *mem_alloc_raw(size_t nbytes);
+// Not owned by the caller, survives it even when it exits with THREAD_ATTR_RECLAIM
+void *mem_alloc_raw_shared(size_t nbytes);
+// Zeroed ahead of time by the kernel when it has nothing else to do
+void *mem_calloc_raw(size_t nbytes);
+int mem_free_raw(void *ptr);
+void *mem_realloc_raw(void *ptr, size_t nbytes);
+size_t mem_alloc_raw_batch(size_t count, size_t nbytes, void **out);
+size_t mem_free_raw_batch(void **ptrs, size_t count);
+// Tells the kernel where the caller's slot counters are so its live bytes count slots instead of whole chunks
+int mem_slots_raw(struct __thread_mem_slots_t *slots);
+
+#endif //USER_MEM_HEADER
+
+#ifdef __cplusplus
+}
+#endif
@@ -21,8 +21,8 @@ void __console_init()
 {
     u64 console_buffer_size_in_blocks = (CONSOLE_BUFFER_SIZE + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
 
-    console_receive_buffer = __mem_alloc(console_buffer_size_in_blocks);
-    console_send_buffer = __mem_alloc(console_buffer_size_in_blocks);
+    console_receive_buffer = __mem_alloc(&kernel_heap, console_buffer_size_in_blocks);
+    console_send_buffer = __mem_alloc(&kernel_heap, console_buffer_size_in_blocks);
 
     console_receive_cnt = 0;
     console_send_cnt = 0;
@@ -125,7 +125,7 @@ void __console_receive()
         context->a0 = console_receive_buffer[unblocked_cnt];
         unblocked_cnt++;
 
-        __scheduler_push(unblocked_thread);
+        __scheduler_wake(unblocked_thread);
     }
 
     console_receive_cnt -= unblocked_cnt;
@@ -1,6 +1,7 @@
 #include "../h/console.h"
 #include "../h/kernel.h"
 #include "../h/mem.h"
+#include "../h/slab.h"
 
 void __print_u64(u64 var)
 {
@@ -92,6 +93,42 @@ void __print_mem(char *msg, u64 mem)
     __putc('\n');
 }
 
+// De Bruijn lookup, mask must have exactly one bit set
+u64 __bit_index(u64 mask)
+{
+    static u8 index[64] =
+    {
+         0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+        62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12
+    };
+
+    return index[(mask * 0x022FDD63CC95386DULL) >> 58];
+}
+
+u64 __bit_first_set(u64 mask)
+{
+    return __bit_index(mask & (~mask + 1));
+}
+
+u64 __bit_last_set(u64 mask)
+{
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+    mask |= mask >> 32;
+
+    return __bit_index(mask ^ (mask >> 1));
+}
+
+u64 __time_now()
+{
+    return *(volatile u64 *)CLINT_MTIME;
+}
+
 void __stop()
 {
     __console_send();
@@ -104,7 +141,9 @@ void __stop()
 void __panic(char *msg)
 {
     __console_send();
-    __mem_print();
+    __mem_print(&kernel_heap);
+    __mem_print(&user_heap);
+    __slab_print_all();
 
     __print_str("KERNEL PANIC!\n");
     __print_str(msg);
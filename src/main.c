@@ -12,8 +12,11 @@ extern void userMain();
 
 thread_t kernel_main;
 thread_t user_main;
+thread_t idle;
 u64 system_stack;
 
+struct __boot_stats_t boot_stats;
+
 const u64 IRQ_TIMER = (1ULL << 63) | 0x1;
 const u64 IRQ_HW = (1ULL << 63) | 0x9;
 const u64 IRQ_ILLEGAL_OP = 0x2;
@@ -26,17 +29,38 @@ enum SYSCALL_CODE
 {
     SYSCALL_MEM_ALLOC = 0x1,
     SYSCALL_MEM_FREE,
+    SYSCALL_MEM_STATS,
+    SYSCALL_MEM_REALLOC,
+    SYSCALL_MEM_ALLOC_BATCH,
+    SYSCALL_MEM_FREE_BATCH,
+    SYSCALL_MEM_LIVE_BYTES,
+    SYSCALL_MEM_ALLOC_SHARED,
+    SYSCALL_MEM_CALLOC,
+    SYSCALL_MEM_LARGE_THRESHOLD,
+    SYSCALL_MEM_SLOTS,
     SYSCALL_THREAD_CREATE = 0x11,
     SYSCALL_THREAD_EXIT,
     SYSCALL_THREAD_DISPATCH,
+    SYSCALL_THREAD_CREATE_EX,
+    SYSCALL_THREAD_STACK_USAGE,
+    SYSCALL_THREAD_SET_PRIORITY,
+    SYSCALL_THREAD_GET_PRIORITY,
+    SYSCALL_THREAD_PERIOD_START,
+    SYSCALL_THREAD_PERIOD_WAIT,
+    SYSCALL_THREAD_PERIOD_STOP,
+    SYSCALL_THREAD_PERIOD_OVERRUNS,
+    SYSCALL_THREAD_EDF_START,
+    SYSCALL_THREAD_EDF_MISSES,
     SYSCALL_SEM_OPEN = 0x21,
     SYSCALL_SEM_CLOSE,
     SYSCALL_SEM_WAIT,
     SYSCALL_SEM_SIGNAL,
     SYSCALL_SEM_TIMED_WAIT,
+    SYSCALL_SEM_OPEN_MUTEX = 0x27,
     SYSCALL_TIMED_SLEEP = 0x31,
     SYSCALL_GETC = 0x41,
     SYSCALL_PUTC,
+    SYSCALL_BOOT_STATS = 0x51,
 
     SYSCALL_KERNEL_DISPATCH = 0x91
 };
@@ -62,8 +86,21 @@ void irq_handler()
             thread_t thread_current = __scheduler_current();
             thread_current->time_left--;
 
-            if(thread_current->time_left == 0)
+            if(__scheduler_edf_charge(thread_current))
+            {
+                thread_t thread_next = __scheduler_next();
+                yield(thread_current, thread_next);
+
+                __debug_str("EDF budget exhausted\n");
+                return;
+            }
+
+            // A woken thread of higher priority does not wait for the slice to run out
+            if(thread_current->time_left == 0 || __scheduler_preempts(thread_current))
             {
+                if(thread_current->time_left == 0)
+                    __scheduler_demote(thread_current);
+
                 __scheduler_push(thread_current);
 
                 thread_t thread_next = __scheduler_next();
@@ -89,6 +126,19 @@ void irq_handler()
 
             plic_complete(10);
 
+            // Input can wake a thread while the idle thread waits, switch to it right away
+            thread_t thread_current = __scheduler_current();
+
+            if(__scheduler_preempts(thread_current))
+            {
+                __scheduler_push(thread_current);
+
+                thread_t thread_next = __scheduler_next();
+                yield(thread_current, thread_next);
+
+                return;
+            }
+
             break;
         }
         case IRQ_ILLEGAL_OP:
@@ -167,17 +217,138 @@ void irq_handler()
             {
                 case SYSCALL_MEM_ALLOC:
                 {
-                    size_t nblocks = context->a1;
+                    size_t nbytes = context->a1;
+
+                    void *result = __thread_mem_alloc(__scheduler_current(), nbytes);
+                    context->a0 = (u64)result;
+
+                    __debug_mem("Bytes allocated", nbytes);
+                    __debug_mem("Allocated mem start", (u64)result);
+
+                    break;
+                }
+                case SYSCALL_MEM_FREE:
+                {
+                    void *ptr = (void *)context->a1;
+
+                    i32 res = __thread_mem_free(ptr);
+                    context->a0 = res;
+
+                    __debug_mem("Freed mem start", (u64)ptr);
+
+                    break;
+                }
+                case SYSCALL_MEM_STATS:
+                {
+                    struct __mem_stats_t *stats = (struct __mem_stats_t *)context->a1;
+                    u64 heap = context->a2;
+
+                    if(heap != MEM_HEAP_USER && heap != MEM_HEAP_KERNEL)
+                    {
+                        context->a0 = -1;
+                        break;
+                    }
+
+                    __mem_stats(heap == MEM_HEAP_KERNEL ? &kernel_heap : &user_heap, stats);
+                    context->a0 = 0;
+
+                    break;
+                }
+                case SYSCALL_MEM_REALLOC:
+                {
+                    void *ptr = (void *)context->a1;
+                    size_t nbytes = context->a2;
+
+                    void *result = __thread_mem_realloc(ptr, nbytes);
+                    context->a0 = (u64)result;
+
+                    __debug_mem("Reallocated mem start", (u64)ptr);
+                    __debug_mem("Bytes now", nbytes);
+                    __debug_mem("New mem start", (u64)result);
+
+                    break;
+                }
+                case SYSCALL_MEM_ALLOC_BATCH:
+                {
+                    size_t count = context->a1;
+                    size_t nbytes = context->a2;
+                    void **out = (void **)context->a3;
+
+                    context->a0 = __thread_mem_alloc_batch(__scheduler_current(), count, nbytes, out);
+
+                    __debug_mem("Batch allocated", context->a0);
+
+                    break;
+                }
+                case SYSCALL_MEM_FREE_BATCH:
+                {
+                    void **ptrs = (void **)context->a1;
+                    size_t count = context->a2;
+
+                    context->a0 = __thread_mem_free_batch(ptrs, count);
 
-                    void *result = __mem_alloc(nblocks);
+                    __debug_mem("Batch free failures", context->a0);
+
+                    break;
+                }
+                case SYSCALL_MEM_CALLOC:
+                {
+                    size_t nbytes = context->a1;
+
+                    void *result = __thread_mem_calloc(__scheduler_current(), nbytes);
+                    context->a0 = (u64)result;
+
+                    __debug_mem("Zeroed bytes allocated", nbytes);
+                    __debug_mem("Allocated mem start", (u64)result);
+
+                    break;
+                }
+                case SYSCALL_MEM_LIVE_BYTES:
+                {
+                    thread_t thread = (thread_t)context->a1;
+
+                    if(thread == 0ULL)
+                        thread = __scheduler_current();
+
+                    u64 live = thread->owned_bytes;
+
+                    // Chunks the user allocator carves slots from count only with the slots handed out
+                    if(thread->mem_slots)
+                        live = live - thread->mem_slots->chunk_bytes + thread->mem_slots->slot_bytes;
+
+                    context->a0 = live;
+
+                    break;
+                }
+                case SYSCALL_MEM_ALLOC_SHARED:
+                {
+                    size_t nbytes = context->a1;
+
+                    void *result = __thread_mem_alloc(0ULL, nbytes);
                     context->a0 = (u64)result;
 
-                    __debug_mem("Blocks allocated", nblocks);
-                    __debug_mem("Bytes allocated", nblocks * MEM_BLOCK_SIZE);
+                    __debug_mem("Shared bytes allocated", nbytes);
                     __debug_mem("Allocated mem start", (u64)result);
 
                     break;
                 }
+                case SYSCALL_MEM_LARGE_THRESHOLD:
+                {
+                    size_t nblocks = context->a1;
+
+                    context->a0 = __mem_set_large_threshold(&user_heap, nblocks);
+
+                    __debug_mem("Large threshold in blocks", nblocks);
+
+                    break;
+                }
+                case SYSCALL_MEM_SLOTS:
+                {
+                    __scheduler_current()->mem_slots = (struct __thread_mem_slots_t *)context->a1;
+                    context->a0 = 0;
+
+                    break;
+                }
                 case SYSCALL_GETC:
                 {
                     // Context switch inside
@@ -231,6 +402,18 @@ void irq_handler()
 
                     break;
                 }
+                case SYSCALL_BOOT_STATS:
+                {
+                    struct __boot_stats_t *stats = (struct __boot_stats_t *)context->a1;
+
+                    stats->boot_time = boot_stats.boot_time;
+                    stats->mem_init_time = boot_stats.mem_init_time;
+                    stats->mem_init_index_writes = boot_stats.mem_init_index_writes;
+                    stats->heap_blocks = boot_stats.heap_blocks;
+                    context->a0 = 0;
+
+                    break;
+                }
                 case SYSCALL_THREAD_CREATE:
                 {
                     u64 thread_new = context->a1;
@@ -243,13 +426,190 @@ void irq_handler()
                     __debug_mem("arg", arg);
                     __debug_mem("stack space", stack_space);
 
-                    i32 result = __thread_create((thread_t *)thread_new, (void *)start_f, (void *)arg, (void *)stack_space, EXEC_MODE_USER);
+                    i32 result = __thread_create((thread_t *)thread_new, (void *)start_f, (void *)arg, (void *)stack_space, EXEC_MODE_USER, 0ULL);
                     context->a0 = result;
 
                     __debug_str("Created thread\n");
 
                     break;
                 }
+                case SYSCALL_THREAD_CREATE_EX:
+                {
+                    u64 thread_new = context->a1;
+                    u64 start_f = context->a2;
+                    u64 arg = context->a3;
+                    u64 attr = context->a4;
+
+                    __debug_mem("new thread handle", thread_new);
+                    __debug_mem("thread attributes", attr);
+
+                    i32 result = __thread_create((thread_t *)thread_new, (void *)start_f, (void *)arg, 0ULL, EXEC_MODE_USER, (struct __thread_attr_t *)attr);
+                    context->a0 = result;
+
+                    __debug_str("Created thread with attributes\n");
+
+                    break;
+                }
+                case SYSCALL_THREAD_STACK_USAGE:
+                {
+                    u64 thread = context->a1;
+
+                    if(thread == 0ULL)
+                        thread = (u64)__scheduler_current();
+
+                    __debug_mem("Stack usage of", thread);
+
+                    i64 result = __thread_stack_high_water((thread_t)thread);
+                    context->a0 = result;
+
+                    break;
+                }
+                case SYSCALL_THREAD_SET_PRIORITY:
+                {
+                    u64 thread = context->a1;
+                    u64 priority = context->a2;
+
+                    if(thread == 0ULL)
+                        thread = (u64)__scheduler_current();
+
+                    __debug_mem("Set priority of", thread);
+                    __debug_mem("priority", priority);
+
+                    if(priority >= THREAD_PRIORITY_LEVELS)
+                    {
+                        context->a0 = -1;
+                        break;
+                    }
+
+                    context->a0 = __scheduler_set_priority((thread_t)thread, (u32)priority);
+
+                    // Lowering the caller or raising a ready thread above it hands the CPU over right away
+                    thread_t thread_current = __scheduler_current();
+
+                    if(__scheduler_preempts(thread_current))
+                    {
+                        __scheduler_push(thread_current);
+
+                        thread_t thread_next = __scheduler_next();
+                        yield(thread_current, thread_next);
+
+                        return;
+                    }
+
+                    break;
+                }
+                case SYSCALL_THREAD_GET_PRIORITY:
+                {
+                    u64 thread = context->a1;
+
+                    if(thread == 0ULL)
+                        thread = (u64)__scheduler_current();
+
+                    context->a0 = ((thread_t)thread)->priority;
+
+                    break;
+                }
+                case SYSCALL_THREAD_PERIOD_START:
+                {
+                    u64 period = context->a1;
+
+                    __debug_mem("Period", period);
+
+                    context->a0 = __scheduler_period_start(__scheduler_current(), (time_t)period);
+
+                    break;
+                }
+                case SYSCALL_THREAD_PERIOD_WAIT:
+                {
+                    thread_t thread_current = __scheduler_current();
+                    i32 result = __scheduler_period_wait(thread_current);
+
+                    context->a0 = result < 0 ? -1 : 0;
+
+                    if(result <= 0)
+                        break;
+
+                    thread_t thread_next = __scheduler_next();
+                    yield(thread_current, thread_next);
+
+                    __debug_mem("Thread waits for release", (u64)thread_current);
+
+                    return;
+                }
+                case SYSCALL_THREAD_PERIOD_STOP:
+                {
+                    u64 thread = context->a1;
+
+                    if(thread == 0ULL)
+                        thread = (u64)__scheduler_current();
+
+                    __debug_mem("Stop periodic", thread);
+
+                    context->a0 = __scheduler_period_stop((thread_t)thread);
+
+                    // The released thread may outrank the caller
+                    thread_t thread_current = __scheduler_current();
+
+                    if(__scheduler_preempts(thread_current))
+                    {
+                        __scheduler_push(thread_current);
+
+                        thread_t thread_next = __scheduler_next();
+                        yield(thread_current, thread_next);
+
+                        return;
+                    }
+
+                    break;
+                }
+                case SYSCALL_THREAD_PERIOD_OVERRUNS:
+                {
+                    u64 thread = context->a1;
+
+                    if(thread == 0ULL)
+                        thread = (u64)__scheduler_current();
+
+                    context->a0 = ((thread_t)thread)->periodic.overruns;
+
+                    break;
+                }
+                case SYSCALL_THREAD_EDF_START:
+                {
+                    u64 period = context->a1;
+                    u64 budget = context->a2;
+                    u64 deadline = context->a3;
+
+                    __debug_mem("EDF period", period);
+                    __debug_mem("EDF budget", budget);
+                    __debug_mem("EDF deadline", deadline);
+
+                    thread_t thread_current = __scheduler_current();
+                    context->a0 = __scheduler_edf_start(thread_current, (time_t)period, (time_t)budget, (time_t)deadline);
+
+                    // An admitted thread outranks every priority level but may still have a later deadline
+                    if(__scheduler_preempts(thread_current))
+                    {
+                        __scheduler_push(thread_current);
+
+                        thread_t thread_next = __scheduler_next();
+                        yield(thread_current, thread_next);
+
+                        return;
+                    }
+
+                    break;
+                }
+                case SYSCALL_THREAD_EDF_MISSES:
+                {
+                    u64 thread = context->a1;
+
+                    if(thread == 0ULL)
+                        thread = (u64)__scheduler_current();
+
+                    context->a0 = ((thread_t)thread)->edf.misses;
+
+                    break;
+                }
                 case SYSCALL_THREAD_EXIT:
                 {
                     __debug_str("syscall thread exit\n");
@@ -344,6 +704,30 @@ void irq_handler()
 
                     __debug_str("Signaled semaphore\n");
 
+                    // The woken thread may outrank the caller, or the caller just gave back an inherited level
+                    thread_t thread_current = __scheduler_current();
+
+                    if(__scheduler_preempts(thread_current))
+                    {
+                        __scheduler_push(thread_current);
+
+                        thread_t thread_next = __scheduler_next();
+                        yield(thread_current, thread_next);
+
+                        return;
+                    }
+
+                    break;
+                }
+                case SYSCALL_SEM_OPEN_MUTEX:
+                {
+                    u64 semaphore = context->a1;
+
+                    __debug_mem("new mutex handle", semaphore);
+
+                    i32 res = __sem_open_mutex((sem_t *)semaphore);
+                    context->a0 = res;
+
                     break;
                 }
                 case SYSCALL_SEM_TIMED_WAIT:
@@ -455,20 +839,28 @@ void irq_handler()
 
 int main()
 {
+    u64 boot_start = __time_now();
+
     ASM("li t0, 0x2");
     ASM("csrc sstatus, t0");
     ASM("csrw stvec, %[irq_wrap]" : : [irq_wrap] "r" (irq_wrap));
 
     __mem_init();
+
+    boot_stats.mem_init_time = __time_now() - boot_start;
+    boot_stats.mem_init_index_writes = mem_index_writes;
+    boot_stats.heap_blocks = kernel_heap.n_blocks + user_heap.n_blocks;
+
     __console_init();
+    __thread_init();
+    __sem_init();
     
     __debug_str("bleh\n");
 
     __debug_mem("HEAP_START_ADDR", (u64)HEAP_START_ADDR);
     __debug_mem("HEAP_END_ADDR", (u64)HEAP_END_ADDR);
 
-    u64 thread_size_in_blocks = (sizeof(*kernel_main) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-    kernel_main = __mem_alloc(thread_size_in_blocks);
+    kernel_main = __slab_alloc(&thread_cache);
 
     if(kernel_main == 0ULL)
         __panic("Failed to allocate kernel main thread\n");
@@ -476,45 +868,56 @@ int main()
     __debug_mem("kernel_main", (u64)kernel_main);
     kernel_main->bp = 0ULL;
     kernel_main->time_left = 1;
+    kernel_main->time_slice = DEFAULT_TIME_SLICE;
+    kernel_main->stack_size = 0;
+    kernel_main->stack_owned = 0;
+    kernel_main->priority = 0;
+    kernel_main->level = 0;
+    kernel_main->ready = 0;
+    kernel_main->timer.slot = 0ULL;
+    kernel_main->edf.budget = 0ULL;
+    kernel_main->boosted = 0;
+    kernel_main->held_mutexes = 0ULL;
+    kernel_main->blocked_on = 0ULL;
 
     __scheduler_init(kernel_main);
 
     u64 stack_size_in_blocks = (DEFAULT_STACK_SIZE + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
 
-    system_stack = (u64)__mem_alloc(stack_size_in_blocks);
-    u64 user_stack = (u64)__mem_alloc(stack_size_in_blocks);
+    system_stack = (u64)__mem_alloc(&kernel_heap, stack_size_in_blocks);
+    u64 idle_stack = (u64)__mem_alloc(&kernel_heap, stack_size_in_blocks);
+    u64 user_stack = (u64)__mem_alloc(&user_heap, stack_size_in_blocks);
 
     if(system_stack == 0ULL)
         __panic("Failed to allocate system stack\n");
 
+    if(idle_stack == 0ULL)
+        __panic("Failed to allocate idle stack\n");
+
     if(user_stack == 0ULL)
         __panic("Failed to allocate user main stack");
 
     system_stack += DEFAULT_STACK_SIZE - 8ULL;
+    idle_stack += DEFAULT_STACK_SIZE - 8ULL;
     user_stack += DEFAULT_STACK_SIZE - 8ULL;
 
+    if(__thread_create(&idle, __scheduler_idle_loop, 0, (void *)idle_stack, EXEC_MODE_KERNEL, 0ULL))
+        __panic("Failed to allocate idle thread\n");
+
+    __scheduler_set_idle(idle);
+
     __debug_str("Creating user main\n");
-    if(__thread_create(&user_main, userMain, 0, (void *)user_stack, EXEC_MODE_USER))
+    if(__thread_create(&user_main, userMain, 0, (void *)user_stack, EXEC_MODE_USER, 0ULL))
         __panic("Failed to allocate user main thread\n");
 
     __debug_mem("user_main", (u64)user_main);
     __debug_mem("user_main stack", (u64)user_stack);
 
-    ASM("move a0, %[kernel_main_dispatch]" : : [kernel_main_dispatch] "r" (SYSCALL_KERNEL_DISPATCH));
-    ASM("ecall");
+    boot_stats.boot_time = __time_now() - boot_start;
 
+    // Kernel main is not queued again until the last user thread exits, the idle thread covers the gaps
     while(__scheduler_user_thread_count())
     {
-        u64 sstatus;
-        u64 int_enable_sstatus;
-
-        ASM("csrr %[sstatus], sstatus" : [sstatus] "=r" (sstatus));
-        int_enable_sstatus = sstatus | (1 << 1);
-
-        // Allow timer interrupt for 1 instruction
-        ASM("csrw sstatus, %[int_enable_sstatus]" : : [int_enable_sstatus] "r" (int_enable_sstatus));
-        ASM("csrw sstatus, %[sstatus]" : : [sstatus] "r" (sstatus));
-
         ASM("move a0, %[kernel_main_dispatch]" : : [kernel_main_dispatch] "r" (SYSCALL_KERNEL_DISPATCH));
         ASM("ecall");
     }
@@ -1,141 +1,947 @@
 #include "../h/mem.h"
 #include "../h/kernel.h"
 
-i32 *mem_index;
-u64 n_mem_blocks;
-u64 mem_index_len_in_blocks;
+struct __mem_heap_t kernel_heap;
+struct __mem_heap_t user_heap;
 
-enum FREE_ERRORS
+u64 mem_index_writes;
+
+list_t *__mem_block_node(struct __mem_heap_t *heap, u64 block)
 {
-    FREE_OUT_OF_HEAP = -1,
-    FREE_NOT_BLOCK_ALLIGNED = -2,
-    FREE_NOT_ALLOCED = -3,
-    FREE_NOT_START_OF_ALLOC = -4,
-};
+    return (list_t *)(heap->start + block * MEM_BLOCK_SIZE);
+}
 
-void __mem_init()
+u64 __mem_node_block(struct __mem_heap_t *heap, list_t *node)
+{
+    return ((u64)node - (u64)heap->start) / MEM_BLOCK_SIZE;
+}
+
+void __mem_class_insert(struct __mem_heap_t *heap, u64 block, u64 size)
+{
+    u64 class = __bit_last_set(size);
+    list_t *node = __mem_block_node(heap, block);
+
+    if(heap->free_runs[class] == 0ULL)
+    {
+        node->next = node;
+        node->prev = node;
+    }
+    else
+        list_insert(heap->free_runs[class], node);
+
+    heap->free_runs[class] = node;
+    heap->free_run_count[class]++;
+    heap->free_classes |= 1ULL << class;
+}
+
+void __mem_class_remove(struct __mem_heap_t *heap, u64 block, u64 size)
+{
+    u64 class = __bit_last_set(size);
+    list_t *node = __mem_block_node(heap, block);
+
+    heap->free_run_count[class]--;
+
+    if(node->next == node)
+    {
+        heap->free_runs[class] = 0ULL;
+        heap->free_classes &= ~(1ULL << class);
+
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    if(heap->free_runs[class] == node)
+        heap->free_runs[class] = node->next;
+}
+
+#ifdef MEM_COMPACT_INDEX
+u64 __mem_bit(u64 *map, u64 block)
 {
-    n_mem_blocks = (HEAP_END_ADDR - HEAP_START_ADDR) / MEM_BLOCK_SIZE;
-    mem_index_len_in_blocks = (sizeof(u32) * n_mem_blocks + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+    return (map[block / 64] >> (block % 64)) & 1ULL;
+}
 
-    mem_index = (i32 *)HEAP_START_ADDR;
+void __mem_bit_put(u64 *map, u64 block, u64 value)
+{
+    if(value)
+        map[block / 64] |= 1ULL << (block % 64);
+    else
+        map[block / 64] &= ~(1ULL << (block % 64));
 
-    for(u64 i = 0; i < n_mem_blocks; i++)
-        mem_index[i] = 0;
+    mem_index_writes++;
+}
 
-    mem_index[0] = mem_index_len_in_blocks;
-    mem_index[mem_index_len_in_blocks - 1] = mem_index_len_in_blocks;
-    mem_index[mem_index_len_in_blocks] = -(n_mem_blocks - mem_index_len_in_blocks);
-    mem_index[n_mem_blocks - 1] = -(n_mem_blocks - mem_index_len_in_blocks);
+void __mem_bits_clear(u64 *map, u64 from, u64 to)
+{
+    while(from < to && from % 64)
+        __mem_bit_put(map, from++, 0);
+
+    for(; from + 64 <= to; from += 64)
+    {
+        map[from / 64] = 0ULL;
+        mem_index_writes += 64;
+    }
+
+    while(from < to)
+        __mem_bit_put(map, from++, 0);
 }
 
-void __mem_print()
+// Size of a free run lives after the list node, both in its first and its last block
+u64 *__mem_run_size_slot(struct __mem_heap_t *heap, u64 block)
 {
-    for(u64 i = 0; i < n_mem_blocks; i++)
+    return (u64 *)(__mem_block_node(heap, block) + 1);
+}
+
+// Start of the run after the one starting at block
+u64 __mem_next_run(struct __mem_heap_t *heap, u64 block)
+{
+    u64 i = block + 1;
+
+    while(i < heap->n_blocks)
     {
-        if(mem_index[i] != 0)
+        u64 word = heap->run_starts[i / 64] >> (i % 64);
+
+        if(word)
         {
-            __print_i32(mem_index[i]);
-            __print_str(" ");
+            i += __bit_first_set(word);
+            return i < heap->n_blocks ? i : heap->n_blocks;
         }
+
+        i = (i / 64 + 1) * 64;
+    }
+
+    return heap->n_blocks;
+}
+#endif
+
+#ifndef MEM_COMPACT_INDEX
+// The last block of a run longer than one holds its tag pushed this far away from zero, so it never passes for a first block
+#define MEM_TAG_LAST (1 << 30)
+#endif
+
+// Tag accessors, block always has to be the first block of a run unless stated otherwise
+
+// Size of the allocated run starting at block
+u64 __mem_alloc_size(struct __mem_heap_t *heap, u64 block)
+{
+#ifdef MEM_COMPACT_INDEX
+    return __mem_next_run(heap, block) - block;
+#else
+    return heap->index[block];
+#endif
+}
+
+// Size of the run starting at block if it is free, 0 if it is allocated or past the heap
+u64 __mem_free_at(struct __mem_heap_t *heap, u64 block)
+{
+    if(block >= heap->n_blocks)
+        return 0;
+
+#ifdef MEM_COMPACT_INDEX
+    return __mem_bit(heap->run_allocs, block) ? 0 : *__mem_run_size_slot(heap, block);
+#else
+    return heap->index[block] < 0 ? -heap->index[block] : 0;
+#endif
+}
+
+// Size of the run ending right before block if it is free, 0 otherwise
+u64 __mem_free_before(struct __mem_heap_t *heap, u64 block)
+{
+    if(block == 0)
+        return 0;
+
+#ifdef MEM_COMPACT_INDEX
+    return __mem_bit(heap->run_allocs, block - 1) ? 0 : *__mem_run_size_slot(heap, block - 1);
+#else
+    i32 tag = heap->index[block - 1];
+
+    if(tag >= 0)
+        return 0;
+
+    return -tag > MEM_TAG_LAST ? -tag - MEM_TAG_LAST : -tag;
+#endif
+}
+
+// Marks [block, block + |tag|) as one run, allocated for a positive tag and free for a negative one
+void __mem_tag_run(struct __mem_heap_t *heap, u64 block, i64 tag)
+{
+    u64 size = tag < 0 ? -tag : tag;
+
+#ifdef MEM_COMPACT_INDEX
+    __mem_bit_put(heap->run_starts, block + size - 1, 0);
+    __mem_bit_put(heap->run_starts, block, 1);
+    __mem_bit_put(heap->run_allocs, block, tag > 0);
+    __mem_bit_put(heap->run_allocs, block + size - 1, tag > 0);
+
+    if(tag < 0)
+    {
+        *__mem_run_size_slot(heap, block) = size;
+        *__mem_run_size_slot(heap, block + size - 1) = size;
+    }
+#else
+    heap->index[block] = tag;
+    mem_index_writes++;
+
+    if(size > 1)
+    {
+        heap->index[block + size - 1] = tag < 0 ? tag - MEM_TAG_LAST : tag + MEM_TAG_LAST;
+        mem_index_writes++;
+    }
+#endif
+}
+
+// Block stops being a run boundary, the runs on both of its sides are about to be retagged as one
+void __mem_untag(struct __mem_heap_t *heap, u64 block)
+{
+#ifdef MEM_COMPACT_INDEX
+    __mem_bit_put(heap->run_starts, block, 0);
+#else
+    heap->index[block - 1] = 0;
+    heap->index[block] = 0;
+    mem_index_writes += 2;
+#endif
+}
+
+// Zeroes the part of [from, to) that was never written, always an edge of the untouched range
+void __mem_index_touch(struct __mem_heap_t *heap, u64 from, u64 to)
+{
+    if(from < heap->untouched_start)
+        from = heap->untouched_start;
+
+    if(to > heap->untouched_end)
+        to = heap->untouched_end;
+
+    if(from >= to)
+        return;
+
+    if(to != heap->untouched_end)
+        from = heap->untouched_start;
+
+#ifdef MEM_COMPACT_INDEX
+    __mem_bits_clear(heap->run_starts, from, to);
+#else
+    for(u64 i = from; i < to; i++)
+        heap->index[i] = 0;
+
+    mem_index_writes += to - from;
+#endif
+
+    if(to == heap->untouched_end)
+        heap->untouched_end = from;
+    else
+        heap->untouched_start = to;
+}
+
+void __mem_heap_init(struct __mem_heap_t *heap, char *name, const void *start, const void *end)
+{
+    heap->name = name;
+    heap->start = start;
+    heap->end = end;
+    heap->n_blocks = (heap->end - heap->start) / MEM_BLOCK_SIZE;
+
+#ifdef MEM_COMPACT_INDEX
+    u64 map_words = (heap->n_blocks + 63) / 64;
+    heap->index_len_in_blocks = (2 * sizeof(u64) * map_words + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+
+    heap->run_starts = (u64 *)heap->start;
+    heap->run_allocs = heap->run_starts + map_words;
+#else
+    heap->index_len_in_blocks = (sizeof(u32) * heap->n_blocks + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+
+    heap->index = (i32 *)heap->start;
+#endif
+
+    // Only the boundary tags are written, the interior of the one free run is zeroed lazily as it gets split
+    __mem_tag_run(heap, 0, heap->index_len_in_blocks);
+    __mem_tag_run(heap, heap->index_len_in_blocks, -(heap->n_blocks - heap->index_len_in_blocks));
+
+    heap->untouched_start = heap->index_len_in_blocks + 1;
+    heap->untouched_end = heap->n_blocks - 1;
+
+    for(u64 i = 0; i < MEM_CLASS_COUNT; i++)
+    {
+        heap->free_runs[i] = 0ULL;
+        heap->free_run_count[i] = 0;
+    }
+
+    heap->free_classes = 0ULL;
+
+    for(u64 i = 0; i < MEM_ZERO_POOL_CLASSES; i++)
+    {
+        heap->zero_pool[i] = 0ULL;
+        heap->zero_pool_count[i] = 0;
+    }
+
+    heap->zero_pool_blocks = 0;
+    heap->zero_fill = 0ULL;
+
+    heap->large_threshold = MEM_LARGE_THRESHOLD;
+
+    heap->blocks_in_use = 0;
+    heap->blocks_peak = 0;
+    heap->alloc_count = 0;
+    heap->free_count = 0;
+    heap->failed_alloc_count = 0;
+
+    __mem_class_insert(heap, heap->index_len_in_blocks, heap->n_blocks - heap->index_len_in_blocks);
+}
+
+// Kernel objects get a fixed region at the bottom so user programs can not starve them, users get the rest
+void __mem_init()
+{
+    u64 heap_size = (HEAP_END_ADDR - HEAP_START_ADDR) / MEM_BLOCK_SIZE * MEM_BLOCK_SIZE;
+    u64 kernel_size = MEM_KERNEL_HEAP_SIZE / MEM_BLOCK_SIZE * MEM_BLOCK_SIZE;
+
+    if(kernel_size > heap_size / 2)
+        kernel_size = heap_size / 2 / MEM_BLOCK_SIZE * MEM_BLOCK_SIZE;
+
+    mem_index_writes = 0;
+
+    __mem_heap_init(&kernel_heap, "Kernel heap", HEAP_START_ADDR, HEAP_START_ADDR + kernel_size);
+    __mem_heap_init(&user_heap, "User heap", HEAP_START_ADDR + kernel_size, HEAP_START_ADDR + heap_size);
+}
+
+void __mem_stats(struct __mem_heap_t *heap, struct __mem_stats_t *stats)
+{
+    stats->bytes_total = (heap->n_blocks - heap->index_len_in_blocks) * MEM_BLOCK_SIZE;
+    stats->bytes_in_use = heap->blocks_in_use * MEM_BLOCK_SIZE;
+    stats->bytes_peak = heap->blocks_peak * MEM_BLOCK_SIZE;
+    stats->largest_free_run = 0;
+    stats->bytes_pooled = heap->zero_pool_blocks * MEM_BLOCK_SIZE;
+
+    for(u64 i = 0; i < MEM_CLASS_COUNT; i++)
+        stats->free_runs[i] = heap->free_run_count[i];
+
+    stats->alloc_count = heap->alloc_count;
+    stats->free_count = heap->free_count;
+    stats->failed_alloc_count = heap->failed_alloc_count;
+
+    if(heap->free_classes == 0ULL)
+        return;
+
+    // The largest run is somewhere in the highest non-empty class
+    list_t *head = heap->free_runs[__bit_last_set(heap->free_classes)];
+    list_t *node = head;
+    do
+    {
+        u64 size = __mem_free_at(heap, __mem_node_block(heap, node));
+
+        if(size * MEM_BLOCK_SIZE > stats->largest_free_run)
+            stats->largest_free_run = size * MEM_BLOCK_SIZE;
+
+        node = node->next;
+    }
+    while(node != head);
+}
+
+void __mem_print(struct __mem_heap_t *heap)
+{
+    __print_str(heap->name);
+    __print_str("\n");
+
+    struct __mem_stats_t stats;
+    __mem_stats(heap, &stats);
+
+    __print_mem("Heap bytes in use", stats.bytes_in_use);
+    __print_mem("Heap bytes peak", stats.bytes_peak);
+    __print_mem("Largest free run", stats.largest_free_run);
+    __print_mem("Zeroed bytes pooled", stats.bytes_pooled);
+    __print_mem("Failed allocations", stats.failed_alloc_count);
+
+    // Runs are printed as signed sizes, negative ones are free
+    for(u64 i = heap->index_len_in_blocks; i < heap->n_blocks;)
+    {
+        u64 size = __mem_free_at(heap, i);
+
+        if(size)
+            __print_str("-");
+        else
+            size = __mem_alloc_size(heap, i);
+
+        __print_i32(size);
+        __print_str(" ");
+
+        i += size;
     }
 
     __print_str("\n");
 }
 
-void *__mem_alloc(size_t nblocks)
+// Out of the first scan runs in class takes the lowest one that fits nblocks, or the highest for large requests.
+// Every run of a class above nblocks' own fits, in its own class a short scan can miss one that does
+u64 __mem_pick_run(struct __mem_heap_t *heap, u64 class, size_t nblocks, u64 scan)
 {
-    u64 i = 0;
+    u64 best = heap->n_blocks;
+    u64 seen = 0;
 
-    while(i < n_mem_blocks)
+    list_t *node = heap->free_runs[class];
+    do
     {
-        if(mem_index[i] > 0)
-            i += mem_index[i];
+        u64 block = __mem_node_block(heap, node);
 
-        if(mem_index[i] < 0)
+        if(__mem_free_at(heap, block) >= nblocks)
         {
-            i32 free_blocks_count = -mem_index[i];
+            if(best == heap->n_blocks || (nblocks >= heap->large_threshold ? block > best : block < best))
+                best = block;
+        }
+
+        node = node->next;
+    }
+    while(++seen < scan && node != heap->free_runs[class]);
+
+    return best;
+}
 
-            if(free_blocks_count > nblocks)
-            {
-                mem_index[i + free_blocks_count - 1] = -(free_blocks_count - nblocks);
-                mem_index[i + nblocks] = -(free_blocks_count - nblocks);
-                mem_index[i + nblocks - 1] = nblocks;
-                mem_index[i] = nblocks;
+// Picks a free run of at least nblocks, returns heap->n_blocks if there is none
+u64 __mem_find_free_run(struct __mem_heap_t *heap, size_t nblocks)
+{
+    u64 class = __bit_last_set(nblocks);
 
-                //Cast avoids warning about losing const
-                return (void *)(HEAP_START_ADDR + i * MEM_BLOCK_SIZE);
-            }
+    if(class >= MEM_CLASS_COUNT)
+        return heap->n_blocks;
 
-            if(free_blocks_count == nblocks)
-            {
-                mem_index[i] = nblocks;
-                mem_index[i + nblocks - 1] = nblocks;
+    // Every run in a class above nblocks' own is large enough, take any of them
+    u64 fit_class = (nblocks == (1ULL << class)) ? class : class + 1;
+    u64 fit_classes = fit_class < MEM_CLASS_COUNT ? heap->free_classes & ~((1ULL << fit_class) - 1) : 0ULL;
 
-                //Cast avoids warning about losing const
-                return (void *)(HEAP_START_ADDR + i * MEM_BLOCK_SIZE);
-            }
+    if(fit_classes)
+        return __mem_pick_run(heap, __bit_first_set(fit_classes), nblocks, MEM_PLACEMENT_SCAN);
 
-            i += free_blocks_count;
-        }
+    // Only runs sharing nblocks' class are left, the first few of them might still fit
+    if(heap->free_runs[class] == 0ULL)
+        return heap->n_blocks;
+
+    u64 i = __mem_pick_run(heap, class, nblocks, MEM_PLACEMENT_SCAN);
+
+    // Failing while a fitting run is free would break first fit, the whole class is looked at before giving up
+    if(i == heap->n_blocks && heap->free_run_count[class] > MEM_PLACEMENT_SCAN)
+        i = __mem_pick_run(heap, class, nblocks, heap->free_run_count[class]);
+
+    return i;
+}
+
+void *__mem_alloc(struct __mem_heap_t *heap, size_t nblocks)
+{
+    if(nblocks == 0)
+        return 0;
+
+    u64 i = __mem_find_free_run(heap, nblocks);
+
+    // Runs held back for calloc are the first thing to give up under pressure
+    if(i == heap->n_blocks && __mem_zero_pool_drain(heap))
+        i = __mem_find_free_run(heap, nblocks);
+
+    if(i == heap->n_blocks)
+    {
+        heap->failed_alloc_count++;
+        return 0;
+    }
+
+    u64 free_blocks_count = __mem_free_at(heap, i);
+
+    if(free_blocks_count == 0)
+        __panic("Memory index corrupted!\n");
+
+    __mem_class_remove(heap, i, free_blocks_count);
+
+    // Large allocations take the top of the run so long lived stacks do not end up between small short lived objects
+    u64 rest = i + nblocks;
+
+    if(nblocks >= heap->large_threshold)
+    {
+        rest = i;
+        i += free_blocks_count - nblocks;
+    }
+
+    __mem_index_touch(heap, i - 1, i + nblocks + 1);
+
+    if(free_blocks_count > nblocks)
+    {
+        __mem_tag_run(heap, rest, -(free_blocks_count - nblocks));
+        __mem_class_insert(heap, rest, free_blocks_count - nblocks);
+    }
+
+    __mem_tag_run(heap, i, nblocks);
+
+    heap->alloc_count++;
+    heap->blocks_in_use += nblocks;
+
+    if(heap->blocks_in_use > heap->blocks_peak)
+        heap->blocks_peak = heap->blocks_in_use;
+
+    //Cast avoids warning about losing const
+    return (void *)(heap->start + i * MEM_BLOCK_SIZE);
+}
+
+// Starts nblocks at a multiple of align_blocks blocks from the heap start, align_blocks has to be a power of two.
+// The blocks of the run before and after the allocation stay free
+void *__mem_alloc_aligned(struct __mem_heap_t *heap, size_t nblocks, size_t align_blocks)
+{
+    if(nblocks == 0 || align_blocks == 0)
+        return 0;
+
+    // Any run this long holds an aligned piece of nblocks
+    size_t span = nblocks + align_blocks - 1;
+    u64 i = __mem_find_free_run(heap, span);
+
+    if(i == heap->n_blocks && __mem_zero_pool_drain(heap))
+        i = __mem_find_free_run(heap, span);
+
+    if(i == heap->n_blocks)
+    {
+        heap->failed_alloc_count++;
+        return 0;
+    }
+
+    u64 free_blocks_count = __mem_free_at(heap, i);
+
+    if(free_blocks_count == 0)
+        __panic("Memory index corrupted!\n");
+
+    __mem_class_remove(heap, i, free_blocks_count);
 
-        if(mem_index[i] == 0)
+    u64 start = (i + align_blocks - 1) & ~(u64)(align_blocks - 1);
+    u64 head = start - i;
+    u64 tail = free_blocks_count - head - nblocks;
+
+    __mem_index_touch(heap, start - 1, start + nblocks + 1);
+
+    if(head > 0)
+    {
+        __mem_tag_run(heap, i, -head);
+        __mem_class_insert(heap, i, head);
+    }
+
+    if(tail > 0)
+    {
+        __mem_tag_run(heap, start + nblocks, -tail);
+        __mem_class_insert(heap, start + nblocks, tail);
+    }
+
+    __mem_tag_run(heap, start, nblocks);
+
+    heap->alloc_count++;
+    heap->blocks_in_use += nblocks;
+
+    if(heap->blocks_in_use > heap->blocks_peak)
+        heap->blocks_peak = heap->blocks_in_use;
+
+    //Cast avoids warning about losing const
+    return (void *)(heap->start + start * MEM_BLOCK_SIZE);
+}
+
+// Carves as many nblocks sized allocations as possible out of each free run it takes
+size_t __mem_alloc_batch(struct __mem_heap_t *heap, size_t count, size_t nblocks, void **out)
+{
+    size_t done = 0;
+
+    if(nblocks == 0)
+        count = 0;
+
+    while(done < count)
+    {
+        u64 i = __mem_find_free_run(heap, nblocks);
+
+        // Same as __mem_alloc, the zero pool gives its runs back before the batch comes up short
+        if(i == heap->n_blocks && __mem_zero_pool_drain(heap))
+            i = __mem_find_free_run(heap, nblocks);
+
+        if(i == heap->n_blocks)
+            break;
+
+        u64 free_blocks_count = __mem_free_at(heap, i);
+
+        if(free_blocks_count == 0)
             __panic("Memory index corrupted!\n");
+
+        u64 pieces = free_blocks_count / nblocks;
+
+        if(pieces > count - done)
+            pieces = count - done;
+
+        __mem_class_remove(heap, i, free_blocks_count);
+
+        // Large pieces go to the top of the run, same as __mem_alloc places them one at a time
+        u64 first = i;
+        u64 rest = i + pieces * nblocks;
+        u64 rest_size = free_blocks_count - pieces * nblocks;
+
+        if(nblocks >= heap->large_threshold)
+        {
+            first = i + rest_size;
+            rest = i;
+        }
+
+        __mem_index_touch(heap, first - 1, first + pieces * nblocks + 1);
+
+        if(rest_size > 0)
+        {
+            __mem_tag_run(heap, rest, -rest_size);
+            __mem_class_insert(heap, rest, rest_size);
+        }
+
+        for(u64 piece = 0; piece < pieces; piece++)
+        {
+            u64 start = first + piece * nblocks;
+
+            __mem_tag_run(heap, start, nblocks);
+
+            //Cast avoids warning about losing const
+            out[done++] = (void *)(heap->start + start * MEM_BLOCK_SIZE);
+        }
+
+        heap->alloc_count += pieces;
+        heap->blocks_in_use += pieces * nblocks;
     }
 
-    return 0;
+    if(heap->blocks_in_use > heap->blocks_peak)
+        heap->blocks_peak = heap->blocks_in_use;
+
+    heap->failed_alloc_count += count - done;
+
+    for(u64 j = done; j < count; j++)
+        out[j] = 0ULL;
+
+    return done;
 }
 
-int __mem_free(void *ptr)
+// Returns the old threshold, runs already handed out stay where they are
+size_t __mem_set_large_threshold(struct __mem_heap_t *heap, size_t nblocks)
+{
+    size_t old = heap->large_threshold;
+    heap->large_threshold = nblocks;
+
+    return old;
+}
+
+// Index entry of the allocation starting at ptr, or one of FREE_ERRORS
+i64 __mem_alloc_entry(struct __mem_heap_t *heap, void *ptr)
 {
     u64 abs_ptr = (u64)ptr;
-    u64 mem_index_entry = (abs_ptr - (u64)HEAP_START_ADDR) / MEM_BLOCK_SIZE;
+    u64 mem_index_entry = (abs_ptr - (u64)heap->start) / MEM_BLOCK_SIZE;
 
-    if(abs_ptr < (u64)HEAP_START_ADDR || abs_ptr >= (u64)HEAP_END_ADDR)
+    if(abs_ptr < (u64)heap->start || abs_ptr >= (u64)heap->end)
         return FREE_OUT_OF_HEAP;
 
-    if((abs_ptr - (u64)HEAP_START_ADDR) % MEM_BLOCK_SIZE)
+    if((abs_ptr - (u64)heap->start) % MEM_BLOCK_SIZE)
         return FREE_NOT_BLOCK_ALLIGNED;
 
-    if(mem_index[mem_index_entry] <= 0)
+    // The index is not part of the allocatable heap
+    if(mem_index_entry < heap->index_len_in_blocks)
+        return FREE_OUT_OF_HEAP;
+
+    if(mem_index_entry >= heap->untouched_start && mem_index_entry < heap->untouched_end)
         return FREE_NOT_ALLOCED;
 
-    if(mem_index[mem_index_entry] != mem_index[mem_index_entry + mem_index[mem_index_entry] - 1])
+    // Both index layouts give the same answer: the last block of an allocation is not its start,
+    // any other block that does not start an allocation was never handed out as one
+#ifdef MEM_COMPACT_INDEX
+    if(!__mem_bit(heap->run_starts, mem_index_entry))
+    {
+        u64 next = mem_index_entry + 1;
+        u64 last = next == heap->n_blocks || __mem_bit(heap->run_starts, next);
+
+        return last && __mem_bit(heap->run_allocs, mem_index_entry) ? FREE_NOT_START_OF_ALLOC : FREE_NOT_ALLOCED;
+    }
+
+    if(!__mem_bit(heap->run_allocs, mem_index_entry))
+        return FREE_NOT_ALLOCED;
+#else
+    i32 tag = heap->index[mem_index_entry];
+
+    if(tag <= 0)
+        return FREE_NOT_ALLOCED;
+
+    if(tag > MEM_TAG_LAST)
         return FREE_NOT_START_OF_ALLOC;
+#endif
+
+    return mem_index_entry;
+}
+
+// Blocks in the allocation starting at ptr, 0 if there is none
+size_t __mem_size(struct __mem_heap_t *heap, void *ptr)
+{
+    i64 mem_index_entry = __mem_alloc_entry(heap, ptr);
+
+    return mem_index_entry < 0 ? 0 : __mem_alloc_size(heap, mem_index_entry);
+}
+
+// Turns [mem_index_entry, mem_index_entry + size) into a free run, merging it with free neighbours
+void __mem_release(struct __mem_heap_t *heap, u64 mem_index_entry, u64 size)
+{
+    u64 prev_size = __mem_free_before(heap, mem_index_entry);
+    u64 next_size = __mem_free_at(heap, mem_index_entry + size);
+
+    if(prev_size)
+    {
+        __mem_class_remove(heap, mem_index_entry - prev_size, prev_size);
+        __mem_untag(heap, mem_index_entry);
 
-    i32 size = mem_index[mem_index_entry];
-    u8 prev_free = mem_index_entry > 0 ? (mem_index[mem_index_entry - 1] < 0) : 0;
-    u8 next_free = mem_index_entry + size < n_mem_blocks ? (mem_index[mem_index_entry + size] < 0) : 0;
+        mem_index_entry -= prev_size;
+        size += prev_size;
+    }
 
-    if(!prev_free && !next_free)
+    if(next_size)
     {
-        mem_index[mem_index_entry] = -size;
-        mem_index[mem_index_entry + size - 1] = -size;
+        __mem_class_remove(heap, mem_index_entry + size, next_size);
+        __mem_untag(heap, mem_index_entry + size);
+
+        size += next_size;
     }
 
-    if(prev_free)
+    __mem_tag_run(heap, mem_index_entry, -size);
+    __mem_class_insert(heap, mem_index_entry, size);
+}
+
+int __mem_free(struct __mem_heap_t *heap, void *ptr)
+{
+    i64 mem_index_entry = __mem_alloc_entry(heap, ptr);
+
+    if(mem_index_entry < 0)
+        return mem_index_entry;
+
+    u64 size = __mem_alloc_size(heap, mem_index_entry);
+
+    heap->free_count++;
+    heap->blocks_in_use -= size;
+
+    __mem_release(heap, mem_index_entry, size);
+
+    return 0;
+}
+
+// Freed entries are cleared, the ones left behind failed, null entries are skipped
+size_t __mem_free_batch(struct __mem_heap_t *heap, void **ptrs, size_t count)
+{
+    size_t failed = 0;
+
+    for(u64 i = 0; i < count; i++)
     {
-        u64 prev_index = mem_index_entry + mem_index[mem_index_entry - 1];
-        i32 joined_size = size - mem_index[mem_index_entry - 1];
+        if(ptrs[i] == 0ULL)
+            continue;
 
-        mem_index[mem_index_entry] = 0;
-        mem_index[mem_index_entry - 1] = 0;
-        mem_index[prev_index] = -joined_size;
-        mem_index[prev_index + joined_size - 1] = -joined_size;
+        if(__mem_free(heap, ptrs[i]))
+        {
+            failed++;
+            continue;
+        }
 
-        mem_index_entry = prev_index;
-        size = joined_size;
+        ptrs[i] = 0ULL;
     }
 
-    if(next_free)
+    return failed;
+}
+
+void *__mem_realloc(struct __mem_heap_t *heap, void *ptr, size_t nblocks)
+{
+    i64 mem_index_entry = __mem_alloc_entry(heap, ptr);
+
+    if(mem_index_entry < 0)
+        return 0;
+
+    if(nblocks == 0)
+    {
+        __mem_free(heap, ptr);
+        return 0;
+    }
+
+    u64 size = __mem_alloc_size(heap, mem_index_entry);
+
+    if(nblocks == size)
+        return ptr;
+
+    // Shrink in place, the cut off tail joins whatever free run follows it
+    if(nblocks < size)
+    {
+        __mem_tag_run(heap, mem_index_entry, nblocks);
+
+        heap->blocks_in_use -= size - nblocks;
+        __mem_release(heap, mem_index_entry + nblocks, size - nblocks);
+
+        return ptr;
+    }
+
+    // Grow in place into the following free run if it is big enough
+    u64 next = mem_index_entry + size;
+    u64 next_size = __mem_free_at(heap, next);
+
+    if(next_size && size + next_size >= nblocks)
+    {
+        __mem_class_remove(heap, next, next_size);
+        __mem_index_touch(heap, next, mem_index_entry + nblocks + 1);
+        __mem_untag(heap, next);
+
+        if(size + next_size > nblocks)
+        {
+            u64 rest = mem_index_entry + nblocks;
+            u64 rest_size = size + next_size - nblocks;
+
+            __mem_tag_run(heap, rest, -rest_size);
+            __mem_class_insert(heap, rest, rest_size);
+        }
+
+        __mem_tag_run(heap, mem_index_entry, nblocks);
+
+        heap->blocks_in_use += nblocks - size;
+
+        if(heap->blocks_in_use > heap->blocks_peak)
+            heap->blocks_peak = heap->blocks_in_use;
+
+        return ptr;
+    }
+
+    u64 *new_ptr = __mem_alloc(heap, nblocks);
+
+    if(new_ptr == 0ULL)
+        return 0;
+
+    for(u64 i = 0; i < size * MEM_BLOCK_SIZE / sizeof(u64); i++)
+        new_ptr[i] = ((u64 *)ptr)[i];
+
+    __mem_free(heap, ptr);
+
+    return new_ptr;
+}
+
+void *__mem_calloc(struct __mem_heap_t *heap, size_t nblocks)
+{
+    if(nblocks == 0)
+        return 0;
+
+    u64 class = __bit_last_set(nblocks);
+
+    if(nblocks != (1ULL << class))
+        class++;
+
+    if(class < MEM_ZERO_POOL_CLASSES && heap->zero_pool[class])
     {
-        i32 joined_size = size - mem_index[mem_index_entry + size];
+        u64 *ptr = heap->zero_pool[class];
+
+        heap->zero_pool[class] = (u64 *)ptr[0];
+        heap->zero_pool_count[class]--;
+        ptr[0] = 0ULL;
 
-        mem_index[mem_index_entry + size - 1] = 0;
-        mem_index[mem_index_entry + size] = 0;
-        mem_index[mem_index_entry] = -joined_size;
-        mem_index[mem_index_entry + joined_size - 1] = -joined_size;
+        // Only now does the run count as an allocation
+        heap->zero_pool_blocks -= 1ULL << class;
+        heap->alloc_count++;
+        heap->blocks_in_use += 1ULL << class;
+
+        // Shrinking is always in place, the tail goes back to the heap
+        ptr = __mem_realloc(heap, ptr, nblocks);
+
+        if(heap->blocks_in_use > heap->blocks_peak)
+            heap->blocks_peak = heap->blocks_in_use;
+
+        return ptr;
+    }
+
+    u64 *ptr = __mem_alloc(heap, nblocks);
+
+    if(ptr == 0ULL)
+        return 0;
+
+    for(u64 i = 0; i < nblocks * MEM_BLOCK_SIZE / sizeof(u64); i++)
+        ptr[i] = 0ULL;
+
+    return ptr;
+}
+
+// Takes the run the next fill steps zero, for the smallest class short of MEM_ZERO_POOL_DEPTH
+int __mem_zero_fill_start(struct __mem_heap_t *heap)
+{
+    for(u64 class = 0; class < MEM_ZERO_POOL_CLASSES; class++)
+    {
+        if(heap->zero_pool_count[class] >= MEM_ZERO_POOL_DEPTH)
+            continue;
+
+        // Never drain the pool to fill it
+        if(__mem_find_free_run(heap, 1ULL << class) == heap->n_blocks)
+            return 0;
+
+        u64 peak = heap->blocks_peak;
+        u64 *ptr = __mem_alloc(heap, 1ULL << class);
+
+        // Pooled runs stay out of the allocation stats until calloc hands them out
+        heap->alloc_count--;
+        heap->blocks_in_use -= 1ULL << class;
+        heap->blocks_peak = peak;
+        heap->zero_pool_blocks += 1ULL << class;
+
+        heap->zero_fill = ptr;
+        heap->zero_fill_class = class;
+        heap->zero_fill_next = 0;
+
+        return 1;
     }
 
     return 0;
 }
+
+// Zeroes a single block so the caller can take interrupts in between, returns 0 when there was nothing to do
+int __mem_zero_pool_fill(struct __mem_heap_t *heap)
+{
+    if(heap->zero_fill == 0ULL && !__mem_zero_fill_start(heap))
+        return 0;
+
+    u64 *block = heap->zero_fill + heap->zero_fill_next * (MEM_BLOCK_SIZE / sizeof(u64));
+
+    for(u64 i = 0; i < MEM_BLOCK_SIZE / sizeof(u64); i++)
+        block[i] = 0ULL;
+
+    heap->zero_fill_next++;
+
+    // Calloc only ever sees whole zeroed runs
+    if(heap->zero_fill_next == 1ULL << heap->zero_fill_class)
+    {
+        u64 *ptr = heap->zero_fill;
+        u64 class = heap->zero_fill_class;
+
+        ptr[0] = (u64)heap->zero_pool[class];
+        heap->zero_pool[class] = ptr;
+        heap->zero_pool_count[class]++;
+        heap->zero_fill = 0ULL;
+    }
+
+    return 1;
+}
+
+// Freed like any run, but it was never counted as in use or allocated
+void __mem_zero_pool_release(struct __mem_heap_t *heap, u64 *ptr, u64 class)
+{
+    heap->zero_pool_blocks -= 1ULL << class;
+    heap->blocks_in_use += 1ULL << class;
+    heap->free_count--;
+
+    __mem_free(heap, ptr);
+}
+
+// Gives every pooled run back to the heap together with the one half zeroed, returns 0 if the pool was empty
+int __mem_zero_pool_drain(struct __mem_heap_t *heap)
+{
+    int drained = 0;
+
+    if(heap->zero_fill)
+    {
+        __mem_zero_pool_release(heap, heap->zero_fill, heap->zero_fill_class);
+        heap->zero_fill = 0ULL;
+        drained = 1;
+    }
+
+    for(u64 class = 0; class < MEM_ZERO_POOL_CLASSES; class++)
+    {
+        while(heap->zero_pool[class])
+        {
+            u64 *ptr = heap->zero_pool[class];
+            heap->zero_pool[class] = (u64 *)ptr[0];
+
+            __mem_zero_pool_release(heap, ptr, class);
+            drained = 1;
+        }
+
+        heap->zero_pool_count[class] = 0;
+    }
+
+    return drained;
+}
@@ -7,34 +7,139 @@ scheduler_t scheduler;
 void __scheduler_init(thread_t kernel_main)
 {
     u64 scheduler_size_in_blocks = (sizeof(*scheduler) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-    scheduler = __mem_alloc(scheduler_size_in_blocks);
+    scheduler = __mem_alloc(&kernel_heap, scheduler_size_in_blocks);
 
     if(scheduler == 0ULL)
         __panic("Failed to allocate scheduler\n");
 
     scheduler->user_thread_count = 0ULL;
-    scheduler->ready_threads = 0ULL;
-    scheduler->sleeping_threads = 0ULL;
+
+    for(u32 level = 0; level < THREAD_PRIORITY_LEVELS; level++)
+        scheduler->ready_threads[level] = 0ULL;
+
+    scheduler->ready_levels = 0ULL;
+    scheduler->edf_ready = 0ULL;
+    scheduler->edf_density = 0ULL;
+#ifdef SCHEDULER_MLFQ
+    scheduler->boost_left = SCHEDULER_BOOST_PERIOD;
+#endif
+    for(u32 level = 0; level < SCHEDULER_WHEEL_LEVELS; level++)
+        for(u32 slot = 0; slot < SCHEDULER_WHEEL_SLOTS; slot++)
+            scheduler->timer_wheel[level][slot] = 0ULL;
+
+    scheduler->ticks = 0ULL;
+    scheduler->sleeping_count = 0ULL;
     scheduler->kernel_main = kernel_main;
     scheduler->thread_current = kernel_main;
+    scheduler->idle = 0ULL;
+#ifdef SCHEDULER_TICKLESS
+    scheduler->tick_stopped = 0;
+#endif
+}
+
+#ifdef SCHEDULER_TICKLESS
+void __scheduler_tick_stop()
+{
+    scheduler->tick_stopped = 1;
+    ASM("csrc sie, 0x2");
+}
+
+void __scheduler_tick_start()
+{
+    scheduler->tick_stopped = 0;
+    ASM("csrs sie, 0x2");
+}
+#endif
+
+void __scheduler_idle_loop(void *arg)
+{
+    while(1)
+    {
+        // Nothing else to do here, zero memory for calloc ahead of time a block per step.
+        // Interrupts pending meanwhile are taken between the steps
+        while(__mem_zero_pool_fill(&user_heap))
+        {
+            ASM("csrs sstatus, 0x2");
+            ASM("csrc sstatus, 0x2");
+        }
+
+#ifdef SCHEDULER_TICKLESS
+        // Every thread is blocked without a timeout, only an external interrupt can change that
+        if(scheduler->sleeping_count == 0ULL)
+            __scheduler_tick_stop();
+#endif
+
+        // Anything that makes a thread ready switches away from here before returning
+        ASM("csrs sstatus, 0x2");
+        ASM("wfi");
+        ASM("csrc sstatus, 0x2");
+    }
+}
+
+void __scheduler_edf_push(thread_t thread)
+{
+    list_t *head = scheduler->edf_ready;
+
+    if(head == 0ULL)
+    {
+        thread->list_node.next = &(thread->list_node);
+        thread->list_node.prev = &(thread->list_node);
+        scheduler->edf_ready = &(thread->list_node);
+
+        return;
+    }
+
+    // Behind every thread with the same deadline
+    list_t *node = head;
+    do
+    {
+        if(container_of(node, struct __thread_t, list_node)->edf.deadline > thread->edf.deadline)
+            break;
+
+        node = node->next;
+    }
+    while(node != head);
+
+    list_insert(node, &(thread->list_node));
+
+    if(node == head && container_of(head, struct __thread_t, list_node)->edf.deadline > thread->edf.deadline)
+        scheduler->edf_ready = &(thread->list_node);
 }
 
 void __scheduler_push(thread_t new_thread)
 {
     __debug_mem("Pushing thread", (u64)new_thread);
 
-    new_thread->time_left = DEFAULT_TIME_SLICE;
+    u32 level = new_thread->level;
+    new_thread->time_left = new_thread->time_slice;
+
+#ifdef SCHEDULER_MLFQ
+    // Lower levels run less often, so they get longer slices
+    new_thread->time_left *= THREAD_PRIORITY_LEVELS - level;
+#endif
+
+    if(new_thread == scheduler->idle)
+        return;
+
+    new_thread->ready = 1;
+
+    if(new_thread->edf.budget)
+    {
+        __scheduler_edf_push(new_thread);
+        return;
+    }
 
-    if(scheduler->ready_threads == 0ULL)
+    if(scheduler->ready_threads[level] == 0ULL)
     {
         new_thread->list_node.next = &(new_thread->list_node);
         new_thread->list_node.prev = &(new_thread->list_node);
-        scheduler->ready_threads = &(new_thread->list_node);
+        scheduler->ready_threads[level] = &(new_thread->list_node);
+        scheduler->ready_levels |= 1ULL << level;
 
         return;
     }
 
-    list_insert(scheduler->ready_threads, &(new_thread->list_node));
+    list_insert(scheduler->ready_threads[level], &(new_thread->list_node));
 
     __debug
     (
@@ -44,35 +149,190 @@ void __scheduler_push(thread_t new_thread)
     return;
 }
 
+void __scheduler_unlink(u32 level, list_t *node)
+{
+    container_of(node, struct __thread_t, list_node)->ready = 0;
+
+    if(node->next == node)
+    {
+        scheduler->ready_threads[level] = 0ULL;
+        scheduler->ready_levels &= ~(1ULL << level);
+
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    if(scheduler->ready_threads[level] == node)
+        scheduler->ready_threads[level] = node->next;
+}
+
+// Takes the freshly created idle thread back out of its run queue
+void __scheduler_set_idle(thread_t idle)
+{
+    __scheduler_unlink(idle->level, &(idle->list_node));
+    scheduler->idle = idle;
+}
+
 thread_t __scheduler_next()
 {
-    if(scheduler->ready_threads == 0ULL)
+    if(scheduler->ready_levels == 0ULL && scheduler->edf_ready == 0ULL)
     {
-        __debug_str("Next is kernel main\n");
-        scheduler->thread_current = scheduler->kernel_main;
-        return scheduler->kernel_main;
+        __debug_str("Next is idle\n");
+        scheduler->thread_current = scheduler->idle;
+        return scheduler->idle;
     }
 
-    if(scheduler->ready_threads->next == scheduler->ready_threads)
+#ifdef SCHEDULER_TICKLESS
+    if(scheduler->tick_stopped)
+        __scheduler_tick_start();
+#endif
+
+    if(scheduler->edf_ready)
     {
-        thread_t next_thread = container_of(scheduler->ready_threads, struct __thread_t, list_node);
+        list_t *head = scheduler->edf_ready;
+        thread_t next_thread = container_of(head, struct __thread_t, list_node);
+        next_thread->ready = 0;
+
+        if(head->next == head)
+            scheduler->edf_ready = 0ULL;
+        else
+        {
+            head->prev->next = head->next;
+            head->next->prev = head->prev;
+            scheduler->edf_ready = head->next;
+        }
+
         scheduler->thread_current = next_thread;
-        scheduler->ready_threads = 0ULL;
 
         return next_thread;
     }
 
-    thread_t next_thread = container_of(scheduler->ready_threads, struct __thread_t, list_node);
+    u32 level = __bit_last_set(scheduler->ready_levels);
+    list_t *head = scheduler->ready_threads[level];
 
-    scheduler->ready_threads->prev->next = scheduler->ready_threads->next;
-    scheduler->ready_threads->next->prev = scheduler->ready_threads->prev;
+    thread_t next_thread = container_of(head, struct __thread_t, list_node);
+    __scheduler_unlink(level, head);
 
-    scheduler->ready_threads = scheduler->ready_threads->next;
     scheduler->thread_current = next_thread;
 
     return next_thread;
 }
 
+// Whether a thread of higher priority than the given one is waiting to run
+int __scheduler_preempts(thread_t thread)
+{
+    if(scheduler->edf_ready)
+    {
+        if(thread->edf.budget == 0ULL)
+            return 1;
+
+        return container_of(scheduler->edf_ready, struct __thread_t, list_node)->edf.deadline < thread->edf.deadline;
+    }
+
+    if(thread->edf.budget)
+        return 0;
+
+    if(thread == scheduler->idle)
+        return scheduler->ready_levels != 0ULL;
+
+    return (scheduler->ready_levels >> thread->level) > 1ULL;
+}
+
+int __scheduler_set_priority(thread_t thread, u32 priority)
+{
+    if(priority >= THREAD_PRIORITY_LEVELS)
+        return -1;
+
+    thread->priority = priority;
+
+#ifdef SCHEDULER_MLFQ
+    // Priority is only the floor a thread can sink to
+    if(__sem_own_level(thread) >= priority)
+        return 0;
+#endif
+
+    // Whatever the thread inherits through its mutexes stays on top of the new level
+    __sem_inherit_update(thread, priority);
+
+    return 0;
+}
+
+void __scheduler_set_level(thread_t thread, u32 level)
+{
+    u32 old_level = thread->level;
+
+    if(old_level == level)
+        return;
+
+    thread->level = level;
+
+    // A ready thread moves to its new queue, anything else picks the level up on its next push.
+    // EDF threads are queued by deadline and stay where they are
+    if(thread->ready && thread->edf.budget == 0ULL)
+    {
+        __scheduler_unlink(old_level, &(thread->list_node));
+        __scheduler_push(thread);
+    }
+}
+
+// Called when a thread used up its whole slice
+void __scheduler_demote(thread_t thread)
+{
+#ifdef SCHEDULER_MLFQ
+    // The feedback moves the thread's own level, what it inherits keeps it above its waiters
+    u32 level = __sem_own_level(thread);
+
+    if(level > thread->priority)
+        __sem_inherit_update(thread, level - 1);
+#endif
+}
+
+// Makes a blocked thread ready again
+void __scheduler_wake(thread_t thread)
+{
+#ifdef SCHEDULER_MLFQ
+    u32 level = __sem_own_level(thread);
+
+    if(level < THREAD_PRIORITY_LEVELS - 1)
+        __sem_inherit_update(thread, level + 1);
+#endif
+
+    __scheduler_push(thread);
+}
+
+#ifdef SCHEDULER_MLFQ
+void __scheduler_boost()
+{
+    u32 top = THREAD_PRIORITY_LEVELS - 1;
+
+    scheduler->boost_left = SCHEDULER_BOOST_PERIOD;
+
+    // Every own level goes back to the top, nothing can inherit more than that
+    __sem_inherit_update(scheduler->thread_current, top);
+
+    // Threads already on top only inherited their way there and stay in place
+    list_t *head = scheduler->ready_threads[top];
+
+    if(head)
+    {
+        list_t *node = head;
+        do
+        {
+            __sem_inherit_update(container_of(node, struct __thread_t, list_node), top);
+            node = node->next;
+        }
+        while(node != head);
+    }
+
+    // Everything below moves up to the end of the top queue
+    for(u32 level = top; level-- > 0;)
+        while(scheduler->ready_threads[level])
+            __sem_inherit_update(container_of(scheduler->ready_threads[level], struct __thread_t, list_node), top);
+}
+#endif
+
 thread_t __scheduler_current()
 {
     __debug
@@ -94,6 +354,10 @@ void __scheduler_user_thread_decrement()
 {
     __debug_str("User thread exited\n");
     scheduler->user_thread_count--;
+
+    // Kernel main only waits for the last user thread to finish
+    if(scheduler->user_thread_count == 0ULL)
+        __scheduler_push(scheduler->kernel_main);
 }
 
 u64 __scheduler_user_thread_count()
@@ -103,7 +367,7 @@ u64 __scheduler_user_thread_count()
 
 void __scheduler_queue_print()
 {
-    if(scheduler->ready_threads == 0ULL)
+    if(scheduler->ready_levels == 0ULL)
     {
         __print_str("Scheduler thread list empty\n");
         return;
@@ -111,211 +375,347 @@ void __scheduler_queue_print()
 
     __print_str("Scheduler thread list:\n");
 
-    list_t *node = scheduler->ready_threads;
-    do
+    for(u32 level = THREAD_PRIORITY_LEVELS; level-- > 0;)
     {
-        thread_t thread = container_of(node, struct __thread_t, list_node);
-        __print_mem("Thread", (u64)thread);
-        node = node->next;
+        list_t *head = scheduler->ready_threads[level];
+
+        if(head == 0ULL)
+            continue;
+
+        __print_mem("Priority", (u64)level);
+
+        list_t *node = head;
+        do
+        {
+            thread_t thread = container_of(node, struct __thread_t, list_node);
+            __print_mem("Thread", (u64)thread);
+            node = node->next;
+        }
+        while(node != head);
     }
-    while(node != scheduler->ready_threads);
 
     __print_str("Scheduler thread list over\n");
 }
 
 void __scheduler_blocked_print()
 {
-    if(scheduler->sleeping_threads == 0ULL)
+    if(scheduler->sleeping_count == 0ULL)
     {
         __print_str("Scheduler blocked thread list empty\n");
         return;
     }
 
     __print_str("Scheduler blocked thread list:\n");
+    __print_mem("Now", (u64)scheduler->ticks);
 
-    list_t *node = scheduler->sleeping_threads;
-    do
+    for(u32 level = 0; level < SCHEDULER_WHEEL_LEVELS; level++)
     {
-        sleeping_thread_t sleeping_thread = container_of(node, struct __sleeping_thread_t, list_node);
-        __print_mem("Thread", (u64)sleeping_thread);
-        __print_mem("Time delta", (u64)sleeping_thread->delta);
-        node = node->next;
+        for(u32 slot = 0; slot < SCHEDULER_WHEEL_SLOTS; slot++)
+        {
+            list_t *head = scheduler->timer_wheel[level][slot];
+
+            if(head == 0ULL)
+                continue;
+
+            list_t *node = head;
+            do
+            {
+                thread_t thread = container_of(node, struct __thread_t, timer.list_node);
+                __print_mem("Thread", (u64)thread);
+                __print_mem("Expires", (u64)thread->timer.expires);
+                node = node->next;
+            }
+            while(node != head);
+        }
     }
-    while(node != scheduler->sleeping_threads);
 
     __print_str("Scheduler blocked thread list over\n");
 }
 
-void __scheduler_timeout(thread_t thread, time_t time, sem_t semaphore)
+void __scheduler_wheel_insert(thread_t thread)
 {
-    if(scheduler->sleeping_threads == 0ULL)
-    {
-        u64 sleeping_thread_size_in_blocks = (sizeof(struct __sleeping_thread_t) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-        sleeping_thread_t sleeping_thread = __mem_alloc(sleeping_thread_size_in_blocks);
+    time_t expires = thread->timer.expires;
+    time_t delta = expires - scheduler->ticks;
+    u32 level = 0;
+
+    while(level < SCHEDULER_WHEEL_LEVELS - 1 && delta >> (SCHEDULER_WHEEL_BITS * (level + 1)))
+        level++;
+
+    // Too far for the wheel, wait in the furthest slot and get filed again when it cascades
+    if(delta >> (SCHEDULER_WHEEL_BITS * SCHEDULER_WHEEL_LEVELS))
+        expires = scheduler->ticks + (1ULL << (SCHEDULER_WHEEL_BITS * SCHEDULER_WHEEL_LEVELS)) - 1;
 
-        sleeping_thread->thread = thread;
-        sleeping_thread->semaphore = semaphore;
-        sleeping_thread->delta = time;
-        sleeping_thread->list_node.next = &(sleeping_thread->list_node);
-        sleeping_thread->list_node.prev = &(sleeping_thread->list_node);
+    u64 slot = (expires >> (SCHEDULER_WHEEL_BITS * level)) & (SCHEDULER_WHEEL_SLOTS - 1);
+    list_t **head = &(scheduler->timer_wheel[level][slot]);
 
-        scheduler->sleeping_threads = &(sleeping_thread->list_node);
+    thread->timer.slot = head;
+
+    if(*head == 0ULL)
+    {
+        thread->timer.list_node.next = &(thread->timer.list_node);
+        thread->timer.list_node.prev = &(thread->timer.list_node);
+        *head = &(thread->timer.list_node);
 
         return;
     }
 
-    list_t *node = scheduler->sleeping_threads;
+    list_insert(*head, &(thread->timer.list_node));
+}
 
-    sleeping_thread_t thread_sleeping_first = container_of(node, struct __sleeping_thread_t, list_node);
-    if(time < thread_sleeping_first->delta)
-    {
-        thread_sleeping_first->delta -= time;
+void __scheduler_wheel_unlink(thread_t thread)
+{
+    list_t **head = thread->timer.slot;
+    list_t *node = &(thread->timer.list_node);
 
-        u64 sleeping_thread_size_in_blocks = (sizeof(struct __sleeping_thread_t) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-        sleeping_thread_t new_head = __mem_alloc(sleeping_thread_size_in_blocks);
+    thread->timer.slot = 0ULL;
 
-        new_head->thread = thread;
-        new_head->semaphore = semaphore;
-        new_head->delta = time;
+    if(node->next == node)
+    {
+        *head = 0ULL;
+        return;
+    }
 
-        new_head->list_node.next = &(thread_sleeping_first->list_node);
-        new_head->list_node.prev = thread_sleeping_first->list_node.prev;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
 
-        (thread_sleeping_first->list_node.prev)->next = &(new_head->list_node);
-        thread_sleeping_first->list_node.prev = &(new_head->list_node);
+    if(*head == node)
+        *head = node->next;
+}
 
-        scheduler->sleeping_threads = &(new_head->list_node);
+// Files every timer of a slot again, each one lands on a lower level
+void __scheduler_wheel_cascade(u32 level, u64 slot)
+{
+    list_t *head = scheduler->timer_wheel[level][slot];
 
+    if(head == 0ULL)
         return;
-    }
 
-    sleeping_thread_t next_thread = container_of(node, struct __sleeping_thread_t, list_node);
-    time_t delta = 0ULL;
+    scheduler->timer_wheel[level][slot] = 0ULL;
 
+    list_t *node = head;
     do
     {
-        delta += next_thread->delta;
-
-        __debug_mem("Thread", (u64)thread);
-        node = node->next;
-        next_thread = container_of(node, struct __sleeping_thread_t, list_node);
+        list_t *next = node->next;
+        __scheduler_wheel_insert(container_of(node, struct __thread_t, timer.list_node));
+        node = next;
     }
-    while((node != scheduler->sleeping_threads) && (delta + next_thread->delta < time));
+    while(node != head);
+}
+
+void __scheduler_timeout(thread_t thread, time_t time, sem_t semaphore)
+{
+    // Expires on the time-th tick from now, nothing can expire on the current one
+    if(time == 0ULL)
+        time = 1;
 
-    u64 sleeping_thread_size_in_blocks = (sizeof(struct __sleeping_thread_t) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-    sleeping_thread_t new_sleeping_thread = __mem_alloc(sleeping_thread_size_in_blocks);
+    if(thread->timer.slot)
+        __panic("Thread already has a timeout\n");
 
-    new_sleeping_thread->thread = thread;
-    new_sleeping_thread->semaphore = semaphore;
-    new_sleeping_thread->delta = time - delta;
+    thread->timer.semaphore = semaphore;
+    thread->timer.expires = scheduler->ticks + time;
 
-    list_insert(node, &(new_sleeping_thread->list_node));
+    scheduler->sleeping_count++;
 
-    if(node != scheduler->sleeping_threads)
-    {
-        sleeping_thread_t next = container_of(node, struct __sleeping_thread_t, list_node);
-        next->delta -= new_sleeping_thread->delta;
-    }
+    __scheduler_wheel_insert(thread);
 }
 
 void __scheduler_remove_timeout(thread_t thread)
 {
-    if(scheduler->sleeping_threads == 0ULL)
-        __panic("Thread lost 1\n");
+    if(thread->timer.slot == 0ULL)
+        __panic("Thread lost\n");
 
-    list_t *sleeping_threads_head = scheduler->sleeping_threads;
-    sleeping_thread_t current_thread = container_of(scheduler->sleeping_threads, struct __sleeping_thread_t, list_node);
+    __scheduler_wheel_unlink(thread);
+    scheduler->sleeping_count--;
+}
 
-    if(sleeping_threads_head->next == sleeping_threads_head)
-    {
-        if(current_thread->thread != thread)
-            __panic("Thread lost 2\n");
+void __scheduler_tick()
+{
+#ifdef SCHEDULER_MLFQ
+    if(--scheduler->boost_left == 0)
+        __scheduler_boost();
+#endif
 
-        if(__mem_free(current_thread))
-            __panic("Failed to free sleeping thread struct, memory corruption\n");
+    scheduler->ticks++;
 
-        scheduler->sleeping_threads = 0ULL;
+    if(scheduler->sleeping_count == 0ULL)
         return;
-    }
 
-    while(current_thread->thread != thread && sleeping_threads_head->next != scheduler->sleeping_threads)
+    // A level cascades whenever every level below it wraps around
+    for(u32 level = 1; level < SCHEDULER_WHEEL_LEVELS; level++)
     {
-        sleeping_threads_head = sleeping_threads_head->next;
-        current_thread = container_of(sleeping_threads_head, struct __sleeping_thread_t, list_node);
+        if((scheduler->ticks >> (SCHEDULER_WHEEL_BITS * (level - 1))) & (SCHEDULER_WHEEL_SLOTS - 1))
+            break;
+
+        __scheduler_wheel_cascade(level, (scheduler->ticks >> (SCHEDULER_WHEEL_BITS * level)) & (SCHEDULER_WHEEL_SLOTS - 1));
     }
 
-    if(current_thread->thread != thread)
-        __panic("Thread lost 3\n");
+    // Everything left in the current slot of the lowest level expires now
+    list_t **slot = &(scheduler->timer_wheel[0][scheduler->ticks & (SCHEDULER_WHEEL_SLOTS - 1)]);
 
-    if(sleeping_threads_head->next == scheduler->sleeping_threads)
+    while(*slot)
     {
-        sleeping_threads_head->prev->next = sleeping_threads_head->next;
-        sleeping_threads_head->next->prev = sleeping_threads_head->prev;
+        thread_t thread = container_of(*slot, struct __thread_t, timer.list_node);
 
-        if(__mem_free(current_thread))
-           __panic("Failed to free sleeping thread struct, memory corruption\n");
+        __scheduler_wheel_unlink(thread);
+        scheduler->sleeping_count--;
 
-        return;
-    }
+        thread->periodic.waiting = 0;
 
-    sleeping_thread_t next_thread = container_of(sleeping_threads_head->next, struct __sleeping_thread_t, list_node);
-    next_thread->delta += current_thread->delta;
+        // Remove from semaphore
+        if(thread->timer.semaphore)
+            __sem_remove_thread(thread->timer.semaphore, thread);
 
-    sleeping_threads_head->prev->next = sleeping_threads_head->next;
-    sleeping_threads_head->next->prev = sleeping_threads_head->prev;
+        __scheduler_wake(thread);
+    }
+}
 
-    if(__mem_free(current_thread))
-       __panic("Failed to free sleeping thread struct, memory corruption\n");
+int __scheduler_period_start(thread_t thread, time_t period)
+{
+    if(period == 0ULL || thread->periodic.terminated)
+        return -1;
 
-    return;
+    thread->periodic.period = period;
+    thread->periodic.release = scheduler->ticks;
+    thread->periodic.overruns = 0ULL;
+
+    return 0;
 }
 
-void __scheduler_tick()
+// Moves a periodic thread on to its next release that is not in the past
+void __scheduler_period_advance(thread_t thread)
 {
-    if(scheduler->sleeping_threads == 0ULL)
-        return;
+    struct __thread_period_t *periodic = &(thread->periodic);
 
-    sleeping_thread_t thread_sleeping_first = container_of(scheduler->sleeping_threads, struct __sleeping_thread_t, list_node);
-    thread_sleeping_first->delta--;
+    periodic->release += periodic->period;
 
-    if(thread_sleeping_first->delta)
-        return;
+    // Releases already missed are skipped and counted, later ones stay on the original cadence
+    if(periodic->release < scheduler->ticks)
+    {
+        u64 missed = (scheduler->ticks - periodic->release + periodic->period - 1) / periodic->period;
 
-    while(thread_sleeping_first->delta == 0)
+        periodic->release += missed * periodic->period;
+        periodic->overruns += missed;
+    }
+
+    if(thread->edf.budget)
     {
-        if(scheduler->sleeping_threads->next == scheduler->sleeping_threads)
-        {
-            // Remove from semaphore
-            if(thread_sleeping_first->semaphore)
-                __sem_remove_thread(thread_sleeping_first->semaphore, thread_sleeping_first->thread);
+        thread->edf.deadline = periodic->release + thread->edf.relative_deadline;
+        thread->edf.budget_left = thread->edf.budget;
+    }
+}
 
-            thread_t thread_first = thread_sleeping_first->thread;
-            __scheduler_push(thread_first);
-            scheduler->sleeping_threads = 0ULL;
+// Returns 1 when the thread was put to sleep until its next release and has to be switched out
+int __scheduler_period_wait(thread_t thread)
+{
+    struct __thread_period_t *periodic = &(thread->periodic);
 
-            if(__mem_free(thread_sleeping_first))
-                __panic("Failed to free sleeping thread struct, memory corruption\n");
+    if(periodic->period == 0ULL || periodic->terminated)
+        return -1;
 
-            return;
-        }
+    // The miss of a spilled job was counted when its budget ran out, the release it ate into is skipped
+    if(thread->edf.spilled)
+    {
+        thread->edf.spilled = 0;
+        periodic->overruns++;
+    }
+    else if(thread->edf.budget && scheduler->ticks > thread->edf.deadline)
+        thread->edf.misses++;
 
-        // Remove from semaphore
-        if(thread_sleeping_first->semaphore)
-            __sem_remove_thread(thread_sleeping_first->semaphore, thread_sleeping_first->thread);
+    __scheduler_period_advance(thread);
+
+    if(periodic->release == scheduler->ticks)
+        return 0;
 
-        thread_t thread_first = thread_sleeping_first->thread;
-        __scheduler_push(thread_first);
+    periodic->waiting = 1;
+    __scheduler_timeout(thread, periodic->release - scheduler->ticks, 0ULL);
 
-        scheduler->sleeping_threads->prev->next = scheduler->sleeping_threads->next;
-        scheduler->sleeping_threads->next->prev = scheduler->sleeping_threads->prev;
+    return 1;
+}
 
-        scheduler->sleeping_threads = scheduler->sleeping_threads->next;
+// Also stops a thread that has not called period start yet, the start then fails
+int __scheduler_period_stop(thread_t thread)
+{
+    thread->periodic.terminated = 1;
 
-        if(__mem_free(thread_sleeping_first))
-            __panic("Failed to free sleeping thread struct, memory corruption\n");
+    // A thread running its activation sees the flag on its next wait
+    if(thread->periodic.waiting)
+    {
+        thread->periodic.waiting = 0;
+        __scheduler_remove_timeout(thread);
 
-        thread_sleeping_first = container_of(scheduler->sleeping_threads, struct __sleeping_thread_t, list_node);
+        ((context_t)thread->sp)->a0 = -1;
+        __scheduler_wake(thread);
     }
 
-    return;
+    return 0;
+}
+
+// Admits the calling thread to the EDF class if the task set stays schedulable, budget <= deadline <= period
+int __scheduler_edf_start(thread_t thread, time_t period, time_t budget, time_t deadline)
+{
+    if(budget == 0ULL || deadline < budget || period < deadline || thread->periodic.terminated)
+        return -1;
+
+    u64 density = (budget * SCHEDULER_EDF_DENSITY_ONE + deadline - 1) / deadline;
+    u64 total = scheduler->edf_density + density;
+
+    // New parameters for an admitted thread replace its old share
+    if(thread->edf.budget)
+        total -= thread->edf.density;
+
+    if(total > SCHEDULER_EDF_DENSITY_ONE)
+        return -2;
+
+    scheduler->edf_density = total;
+
+    thread->periodic.period = period;
+    thread->periodic.release = scheduler->ticks;
+    thread->periodic.overruns = 0ULL;
+
+    thread->edf.budget = budget;
+    thread->edf.relative_deadline = deadline;
+    thread->edf.deadline = scheduler->ticks + deadline;
+    thread->edf.budget_left = budget;
+    thread->edf.density = density;
+    thread->edf.misses = 0ULL;
+    thread->edf.spilled = 0;
+
+    return 0;
+}
+
+// Charges the running thread a tick, returns 1 when an EDF job ran out of budget and sleeps until its next release
+int __scheduler_edf_charge(thread_t thread)
+{
+    if(thread->edf.budget == 0ULL)
+        return 0;
+
+    if(--thread->edf.budget_left)
+        return 0;
+
+    // With the deadline no later than the next release the job can no longer make it.
+    // Its remaining work is charged to the next job, which does not get released on its own
+    if(thread->edf.spilled)
+        thread->periodic.overruns++;
+    else
+        thread->edf.misses++;
+
+    thread->edf.spilled = 1;
+    __scheduler_period_advance(thread);
+
+    if(thread->periodic.release == scheduler->ticks)
+        return 0;
+
+    __scheduler_timeout(thread, thread->periodic.release - scheduler->ticks, 0ULL);
+
+    return 1;
+}
+
+void __scheduler_edf_leave(thread_t thread)
+{
+    if(thread->edf.budget == 0ULL)
+        return;
+
+    scheduler->edf_density -= thread->edf.density;
+    thread->edf.budget = 0ULL;
+    thread->edf.spilled = 0;
 }
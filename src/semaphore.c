@@ -6,6 +6,11 @@ enum SEM_CREATE_ERRORS
     SEM_CREATE_NO_MEMORY = -1,
 };
 
+enum SEM_CLOSE_ERRORS
+{
+    SEM_CLOSE_INVALID = -1,
+};
+
 enum SEM_WAIT_ERRORS
 {
     SEM_CLOSED_EXTERNALLY = -1,
@@ -20,8 +25,11 @@ enum SEM_TRY_WAIT_ERRORS
 enum SEM_SIGNAL_ERRORS
 {
     SEM_SIGNAL_NO_THREADS = -1,
+    SEM_SIGNAL_NOT_OWNER = -2,
 };
 
+struct __slab_cache_t sem_cache;
+
 sem_t first_semaphore = 0ULL;
 sem_t semaphores[10];
 u64 sem_cnt = 0;
@@ -89,10 +97,14 @@ void __sem_first_print()
     __print_str("Semaphore waiting thread list over\n");
 }
 
+void __sem_init()
+{
+    __slab_init(&sem_cache, "Semaphores", sizeof(struct __sem_t));
+}
+
 int __sem_open(sem_t *handle, u32 init)
 {
-    u64 semaphore_size_in_blocks = (sizeof(struct __sem_t) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-    sem_t new_sem = (sem_t)__mem_alloc(semaphore_size_in_blocks);
+    sem_t new_sem = (sem_t)__slab_alloc(&sem_cache);
 
     __debug_mem("New semaphore", (u64)new_sem);
 
@@ -102,19 +114,214 @@ int __sem_open(sem_t *handle, u32 init)
     new_sem->waiting_threads = 0ULL;
     new_sem->init = init;
     new_sem->val = init;
+    new_sem->mutex = 0;
+    new_sem->owner = 0ULL;
     *handle = new_sem;
 
     if(first_semaphore == 0ULL)
         first_semaphore = new_sem;
 
-    semaphores[sem_cnt] = new_sem;
-    sem_cnt++;
+    // Only the first few are kept around for debug printing
+    if(sem_cnt < 10)
+    {
+        semaphores[sem_cnt] = new_sem;
+        sem_cnt++;
+    }
 
     return 0;
 }
 
+int __sem_open_mutex(sem_t *handle)
+{
+    i32 result = __sem_open(handle, 1);
+
+    if(result)
+        return result;
+
+    (*handle)->mutex = 1;
+
+    return 0;
+}
+
+u32 __sem_rank(thread_t thread)
+{
+    if(thread->edf.budget)
+        return THREAD_PRIORITY_LEVELS;
+
+    return thread->level;
+}
+
+u32 __sem_own_level(thread_t thread)
+{
+    return thread->boosted ? thread->base_level : thread->level;
+}
+
+void __sem_push(sem_t handle, thread_t thread)
+{
+    __debug_mem("Waiting thread", (u64)thread);
+
+    if(handle->waiting_threads == 0ULL)
+    {
+        thread->list_node.next = &(thread->list_node);
+        thread->list_node.prev = &(thread->list_node);
+        handle->waiting_threads = &(thread->list_node);
+
+        return;
+    }
+
+    // Behind every waiter of the same rank
+    list_t *head = handle->waiting_threads;
+    list_t *node = head;
+    u32 rank = __sem_rank(thread);
+
+    do
+    {
+        if(__sem_rank(container_of(node, struct __thread_t, list_node)) < rank)
+            break;
+
+        node = node->next;
+    }
+    while(node != head);
+
+    list_insert(node, &(thread->list_node));
+
+    if(node == head && __sem_rank(container_of(head, struct __thread_t, list_node)) < rank)
+        handle->waiting_threads = &(thread->list_node);
+
+    return;
+}
+
+void __sem_unlink(sem_t handle, thread_t thread)
+{
+    list_t *node = &(thread->list_node);
+
+    if(node->next == node)
+    {
+        handle->waiting_threads = 0ULL;
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    if(handle->waiting_threads == node)
+        handle->waiting_threads = node->next;
+}
+
+void __sem_own(sem_t handle, thread_t thread)
+{
+    handle->owner = thread;
+
+    if(thread->held_mutexes == 0ULL)
+    {
+        handle->owner_node.next = &(handle->owner_node);
+        handle->owner_node.prev = &(handle->owner_node);
+        thread->held_mutexes = &(handle->owner_node);
+
+        return;
+    }
+
+    list_insert(thread->held_mutexes, &(handle->owner_node));
+}
+
+void __sem_disown(sem_t handle)
+{
+    thread_t owner = handle->owner;
+    list_t *node = &(handle->owner_node);
+
+    handle->owner = 0ULL;
+
+    if(node->next == node)
+    {
+        owner->held_mutexes = 0ULL;
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    if(owner->held_mutexes == node)
+        owner->held_mutexes = node->next;
+}
+
+// An exiting owner lets go of its mutexes as if it signalled them, the most urgent waiter of each takes over
+void __sem_abandon(thread_t thread)
+{
+    while(thread->held_mutexes)
+    {
+        sem_t handle = container_of(thread->held_mutexes, struct __sem_t, owner_node);
+
+        __sem_disown(handle);
+        handle->val++;
+
+        if(handle->val <= 0 && handle->waiting_threads)
+            __sem_unblock_thread(handle);
+    }
+}
+
+// Raises or lowers a thread to the most urgent waiter on the mutexes it holds and carries the change down the chain of owners
+void __sem_inherit_update(thread_t thread, u32 own_level)
+{
+    while(thread)
+    {
+        u32 level = own_level;
+
+        if(thread->held_mutexes)
+        {
+            list_t *node = thread->held_mutexes;
+            do
+            {
+                sem_t mutex = container_of(node, struct __sem_t, owner_node);
+
+                if(mutex->waiting_threads)
+                {
+                    u32 rank = __sem_rank(container_of(mutex->waiting_threads, struct __thread_t, list_node));
+
+                    if(rank > THREAD_PRIORITY_LEVELS - 1)
+                        rank = THREAD_PRIORITY_LEVELS - 1;
+
+                    if(rank > level)
+                        level = rank;
+                }
+
+                node = node->next;
+            }
+            while(node != thread->held_mutexes);
+        }
+
+        thread->base_level = own_level;
+        thread->boosted = level > own_level;
+
+        if(level == thread->level)
+            return;
+
+        __scheduler_set_level(thread, level);
+
+        sem_t handle = thread->blocked_on;
+
+        if(handle == 0ULL)
+            return;
+
+        // Keep the wait queue ordered under the new level
+        __sem_unlink(handle, thread);
+        __sem_push(handle, thread);
+
+        if(!handle->mutex)
+            return;
+
+        thread = handle->owner;
+
+        if(thread)
+            own_level = __sem_own_level(thread);
+    }
+}
+
 int __sem_close(sem_t handle)
 {
+    // Stale and foreign handles are turned away before anything in them is touched
+    if(__slab_check(&sem_cache, handle))
+        return SEM_CLOSE_INVALID;
+
     if(handle->waiting_threads != 0ULL)
     {
         list_t *first_thread = handle->waiting_threads;
@@ -127,72 +334,67 @@ int __sem_close(sem_t handle)
             thread_t thread = container_of(current_thread, struct __thread_t, list_node);
             context_t context = (context_t)(thread->sp);
 
-            __scheduler_push(thread);
+            thread->blocked_on = 0ULL;
+
+            // A timed waiter must not time out on a semaphore that is gone
+            if(thread->timer.slot)
+                __scheduler_remove_timeout(thread);
+
+            __scheduler_wake(thread);
             context->a0 = SEM_CLOSED_EXTERNALLY;
 
             current_thread = next_thread;
         }
         while(next_thread != first_thread);
-    }
-
-    if(__mem_free(handle))
-        __panic("Failed to free semaphore, memory corruption\n");
 
-    return 0;
-}
-
-void __sem_push(sem_t handle, thread_t thread)
-{
-    __debug_mem("Waiting thread", (u64)thread);
+        handle->waiting_threads = 0ULL;
+    }
 
-    if(handle->waiting_threads == 0ULL)
+    if(handle->owner)
     {
-        thread->list_node.next = &(thread->list_node);
-        thread->list_node.prev = &(thread->list_node);
-        handle->waiting_threads = &(thread->list_node);
+        thread_t owner = handle->owner;
 
-        return;
+        __sem_disown(handle);
+        __sem_inherit_update(owner, __sem_own_level(owner));
     }
 
-    list_insert(handle->waiting_threads, &(thread->list_node));
+    if(__slab_free(&sem_cache, handle))
+        __panic("Failed to free semaphore, memory corruption\n");
 
-    return;
+    return 0;
 }
 
 int __sem_wait(sem_t handle)
 {
+    thread_t thread_current = __scheduler_current();
+
     handle->val--;
 
     if(handle->val < 0)
     {
-        thread_t thread_current = __scheduler_current();
-        thread_t thread_next = __scheduler_next();
+        __sem_push(handle, thread_current);
+        thread_current->blocked_on = handle;
 
+        // The owner runs at least at our level until it lets go
+        if(handle->mutex && handle->owner)
+            __sem_inherit_update(handle->owner, __sem_own_level(handle->owner));
+
+        thread_t thread_next = __scheduler_next();
         yield(thread_current, thread_next);
-        __sem_push(handle, thread_current);
 
         return 1;
     }
 
+    if(handle->mutex)
+        __sem_own(handle, thread_current);
+
     return 0;
 }
 
 thread_t __sem_next(sem_t handle)
 {
-    if(handle->waiting_threads->next == handle->waiting_threads)
-    {
-        thread_t next_thread = container_of(handle->waiting_threads, struct __thread_t, list_node);
-        handle->waiting_threads = 0ULL;
-
-        return next_thread;
-    }
-
     thread_t next_thread = container_of(handle->waiting_threads, struct __thread_t, list_node);
-
-    handle->waiting_threads->prev->next = handle->waiting_threads->next;
-    handle->waiting_threads->next->prev = handle->waiting_threads->prev;
-
-    handle->waiting_threads = handle->waiting_threads->next;
+    __sem_unlink(handle, next_thread);
 
     return next_thread;
 }
@@ -200,20 +402,40 @@ thread_t __sem_next(sem_t handle)
 int __sem_unblock_thread(sem_t handle)
 {
     thread_t unblocked_thread = __sem_next(handle);
+    unblocked_thread->blocked_on = 0ULL;
 
-    if(unblocked_thread->time_left == 0)
+    // Only a timed wait arms a timer while blocked on a semaphore
+    if(unblocked_thread->timer.slot)
         __scheduler_remove_timeout(unblocked_thread);
 
     context_t context = (context_t)(unblocked_thread->sp);
     context->a0 = 0;
 
-    __scheduler_push(unblocked_thread);
+    // Ownership passes straight to the waiter, along with whatever the remaining waiters lend it
+    if(handle->mutex)
+    {
+        __sem_own(handle, unblocked_thread);
+        __sem_inherit_update(unblocked_thread, __sem_own_level(unblocked_thread));
+    }
+
+    __scheduler_wake(unblocked_thread);
 
     return 0;
 }
 
 int __sem_signal(sem_t handle)
 {
+    if(handle->mutex)
+    {
+        thread_t thread_current = __scheduler_current();
+
+        if(handle->owner != thread_current)
+            return SEM_SIGNAL_NOT_OWNER;
+
+        __sem_disown(handle);
+        __sem_inherit_update(thread_current, __sem_own_level(thread_current));
+    }
+
     handle->val++;
 
     if(handle->val <= 0)
@@ -230,37 +452,34 @@ int __sem_signal(sem_t handle)
 int __sem_timed_wait(sem_t handle, time_t time)
 {
     thread_t thread_current = __scheduler_current();
-    thread_current->time_left = 0ULL;
 
     __scheduler_timeout(thread_current, time, handle);
 
-    return __sem_wait(handle);
+    i32 result = __sem_wait(handle);
+
+    // Got it without blocking, the timer must not fire on a thread that is not waiting
+    if(result == 0)
+        __scheduler_remove_timeout(thread_current);
+
+    return result;
 }
 
 void __sem_remove_thread(sem_t handle, thread_t thread)
 {
-    list_t *head = handle->waiting_threads;
-
-    if(head == 0ULL)
+    if(handle->waiting_threads == 0ULL)
         __panic("Thread lost");
 
     handle->val++;
 
-    if(head == head->next)
-    {
-        handle->waiting_threads = 0ULL;
-        return;
-    }
-
-    thread_t current_thread = container_of(head, struct __thread_t, list_node);
-    while(head != &current_thread->list_node)
-        head = head->next;
-
-    head->prev->next = head->next;
-    head->next->prev = head->prev;
+    __sem_unlink(handle, thread);
+    thread->blocked_on = 0ULL;
 
     context_t context = (context_t)(thread->sp);
     context->a0 = SEM_WAIT_TIMEOUT;
 
+    // The owner no longer has to run on behalf of this waiter
+    if(handle->owner)
+        __sem_inherit_update(handle->owner, __sem_own_level(handle->owner));
+
     return;
 }
@@ -0,0 +1,175 @@
+#include "../h/slab.h"
+
+list_t *slab_caches = 0ULL;
+
+enum SLAB_FREE_ERRORS
+{
+    SLAB_FREE_NULL = -1,
+    SLAB_FREE_NOT_IN_CACHE = -2,
+    SLAB_FREE_NOT_START_OF_OBJECT = -3,
+    SLAB_FREE_ALREADY_FREE = -4,
+};
+
+void __slab_init(slab_cache_t cache, char *name, u64 object_size)
+{
+    // Objects stay 8 byte aligned and can always hold the free list link and the free marker
+    object_size = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if(object_size < 2 * sizeof(void *))
+        object_size = 2 * sizeof(void *);
+
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->objects_per_slab = (SLAB_BYTES - sizeof(struct __slab_t)) / object_size;
+    cache->free_objects = 0ULL;
+    cache->slabs = 0ULL;
+    cache->slab_count = 0;
+    cache->objects_in_use = 0;
+
+    if(slab_caches == 0ULL)
+    {
+        cache->cache_node.next = &(cache->cache_node);
+        cache->cache_node.prev = &(cache->cache_node);
+        slab_caches = &(cache->cache_node);
+
+        return;
+    }
+
+    list_insert(slab_caches, &(cache->cache_node));
+}
+
+char *__slab_objects(struct __slab_t *slab)
+{
+    return (char *)(slab + 1);
+}
+
+int __slab_grow(slab_cache_t cache)
+{
+    struct __slab_t *slab = __mem_alloc_aligned(&kernel_heap, SLAB_BLOCKS, SLAB_BLOCKS);
+
+    if(slab == 0ULL)
+        return -1;
+
+    slab->cache = cache;
+
+    if(cache->slabs == 0ULL)
+    {
+        slab->slab_node.next = &(slab->slab_node);
+        slab->slab_node.prev = &(slab->slab_node);
+        cache->slabs = &(slab->slab_node);
+    }
+    else
+        list_insert(cache->slabs, &(slab->slab_node));
+
+    // Thread the new objects in address order so they are handed out densely
+    for(u64 i = cache->objects_per_slab; i > 0; i--)
+    {
+        void **object = (void **)(__slab_objects(slab) + (i - 1) * cache->object_size);
+        object[0] = cache->free_objects;
+        object[1] = (void *)SLAB_FREE_MAGIC;
+        cache->free_objects = object;
+    }
+
+    cache->slab_count++;
+
+    return 0;
+}
+
+void *__slab_alloc(slab_cache_t cache)
+{
+    if(cache->free_objects == 0ULL && __slab_grow(cache))
+        return 0ULL;
+
+    void **object = cache->free_objects;
+    cache->free_objects = object[0];
+    object[1] = 0ULL;
+    cache->objects_in_use++;
+
+    return object;
+}
+
+// Slab of cache that object points into, null if there is none. Constant time, only the one slab object could be in is looked at
+struct __slab_t *__slab_find(slab_cache_t cache, void *object)
+{
+    u64 abs_object = (u64)object;
+
+    if(abs_object < (u64)kernel_heap.start || abs_object >= (u64)kernel_heap.end)
+        return 0ULL;
+
+    //Cast avoids warning about losing const
+    struct __slab_t *slab = (struct __slab_t *)(kernel_heap.start + ((abs_object - (u64)kernel_heap.start) & ~(u64)(SLAB_BYTES - 1)));
+
+    // Anything else at that address is not a slab, its words must not be read as a header
+    if(__mem_size(&kernel_heap, slab) != SLAB_BLOCKS || slab->cache != cache)
+        return 0ULL;
+
+    char *objects = __slab_objects(slab);
+
+    if((char *)object < objects || (char *)object >= objects + cache->objects_per_slab * cache->object_size)
+        return 0ULL;
+
+    return slab;
+}
+
+// 0 if object is a live object of cache, one of SLAB_FREE_ERRORS otherwise
+int __slab_check(slab_cache_t cache, void *object)
+{
+    if(object == 0ULL)
+        return SLAB_FREE_NULL;
+
+    struct __slab_t *slab = __slab_find(cache, object);
+
+    if(slab == 0ULL)
+        return SLAB_FREE_NOT_IN_CACHE;
+
+    if(((char *)object - __slab_objects(slab)) % cache->object_size)
+        return SLAB_FREE_NOT_START_OF_OBJECT;
+
+    if(((void **)object)[1] == (void *)SLAB_FREE_MAGIC)
+        return SLAB_FREE_ALREADY_FREE;
+
+    return 0;
+}
+
+int __slab_free(slab_cache_t cache, void *object)
+{
+    int result = __slab_check(cache, object);
+
+    if(result)
+        return result;
+
+    void **link = object;
+
+    link[0] = cache->free_objects;
+    link[1] = (void *)SLAB_FREE_MAGIC;
+    cache->free_objects = object;
+    cache->objects_in_use--;
+
+    return 0;
+}
+
+void __slab_print(slab_cache_t cache)
+{
+    __print_str(cache->name);
+    __print_str(": ");
+    __print_u64(cache->objects_in_use);
+    __print_str("/");
+    __print_u64(cache->slab_count * cache->objects_per_slab);
+    __print_str(" objects in ");
+    __print_u64(cache->slab_count);
+    __print_str(" slabs\n");
+}
+
+void __slab_print_all()
+{
+    if(slab_caches == 0ULL)
+        return;
+
+    list_t *node = slab_caches;
+    do
+    {
+        __slab_print(container_of(node, struct __slab_cache_t, cache_node));
+        node = node->next;
+    }
+    while(node != slab_caches);
+}
@@ -1,11 +1,7 @@
 #include "../h/syscall_c.h"
+#include "../h/user_mem.h"
 #include "../lib/console.h"
 
-enum THREAD_CREATE_ERRORS
-{
-    THREAD_CREATE_NO_MEMORY = -1,
-};
-
 void putc(char c)
 {
     u64 a1;
@@ -33,13 +29,30 @@ char getc()
 
 void *mem_alloc(size_t nbytes)
 {
-    size_t nblocks = (nbytes + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+    return user_mem_alloc(nbytes);
+}
+
+void *mem_calloc(size_t count, size_t size)
+{
+    if(size && count > ~0ULL / size)
+        return 0ULL;
+
+    return user_mem_calloc(count * size);
+}
+
+int mem_free(void *ptr)
+{
+    return user_mem_free(ptr);
+}
+
+void *mem_alloc_raw(size_t nbytes)
+{
     void *res;
 
     u64 a1;
     __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
 
-    __asm__ __volatile__ ("move a1, %[nblocks]" : : [nblocks] "r" (nblocks));
+    __asm__ __volatile__ ("move a1, %[nbytes]" : : [nbytes] "r" (nbytes));
     __asm__ __volatile__ ("li a0, 0x1");
     __asm__ __volatile__ ("ecall");
 
@@ -48,7 +61,39 @@ void *mem_alloc(size_t nbytes)
     return res;
 }
 
-int mem_free(void *ptr)
+void *mem_alloc_raw_shared(size_t nbytes)
+{
+    void *res;
+
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, %[nbytes]" : : [nbytes] "r" (nbytes));
+    __asm__ __volatile__ ("li a0, 0x8");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+    return res;
+}
+
+void *mem_calloc_raw(size_t nbytes)
+{
+    void *res;
+
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, %[nbytes]" : : [nbytes] "r" (nbytes));
+    __asm__ __volatile__ ("li a0, 0x9");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+    return res;
+}
+
+int mem_free_raw(void *ptr)
 {
     int res;
     u64 a1;
@@ -63,6 +108,151 @@ int mem_free(void *ptr)
     return res;
 }
 
+size_t mem_live_bytes(thread_t handle)
+{
+    size_t res;
+
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, %[handle]" : : [handle] "r" (handle));
+    __asm__ __volatile__ ("li a0, 0x7");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+    return res;
+}
+
+size_t mem_large_threshold(size_t nblocks)
+{
+    size_t res;
+
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, %[nblocks]" : : [nblocks] "r" (nblocks));
+    __asm__ __volatile__ ("li a0, 0xA");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+    return res;
+}
+
+int mem_slots_raw(struct __thread_mem_slots_t *slots)
+{
+    int res;
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, %[slots]" : : [slots] "r" (slots));
+    __asm__ __volatile__ ("li a0, 0xB");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+    return res;
+}
+
+void *mem_realloc(void *ptr, size_t nbytes)
+{
+    return user_mem_realloc(ptr, nbytes);
+}
+
+void *mem_realloc_raw(void *ptr, size_t nbytes)
+{
+    u64 a1, a2;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+
+    __asm__ __volatile__ ("move a2, %[nbytes]" : : [nbytes] "r" (nbytes));
+    __asm__ __volatile__ ("move a1, %[ptr]" : : [ptr] "r" (ptr));
+    __asm__ __volatile__ ("li a0, 0x4");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+
+    void *res;
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+
+    return res;
+}
+
+int mem_alloc_batch(size_t count, size_t size, void *out[])
+{
+    return user_mem_alloc_batch(count, size, out);
+}
+
+int mem_free_batch(void *ptrs[], size_t count)
+{
+    return user_mem_free_batch(ptrs, count);
+}
+
+size_t mem_alloc_raw_batch(size_t count, size_t nbytes, void **out)
+{
+    u64 a1, a2, a3;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+    __asm__ __volatile__ ("move %[a3], a3" : [a3] "=r" (a3));
+
+    __asm__ __volatile__ ("move a3, %[out]" : : [out] "r" (out));
+    __asm__ __volatile__ ("move a2, %[nbytes]" : : [nbytes] "r" (nbytes));
+    __asm__ __volatile__ ("move a1, %[count]" : : [count] "r" (count));
+    __asm__ __volatile__ ("li a0, 0x5");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+    __asm__ __volatile__ ("move a3, %[a3]" : : [a3] "r" (a3));
+
+    size_t res;
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+
+    return res;
+}
+
+size_t mem_free_raw_batch(void **ptrs, size_t count)
+{
+    u64 a1, a2;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+
+    __asm__ __volatile__ ("move a2, %[count]" : : [count] "r" (count));
+    __asm__ __volatile__ ("move a1, %[ptrs]" : : [ptrs] "r" (ptrs));
+    __asm__ __volatile__ ("li a0, 0x6");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+
+    size_t res;
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+
+    return res;
+}
+
+int mem_stats(struct __mem_stats_t *stats, unsigned int heap)
+{
+    u64 a1, a2;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+
+    __asm__ __volatile__ ("move a2, %[heap]" : : [heap] "r" ((u64)heap));
+    __asm__ __volatile__ ("move a1, %[stats]" : : [stats] "r" (stats));
+    __asm__ __volatile__ ("li a0, 0x3");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+
+    i32 res;
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+
+    return res;
+}
+
 int thread_create(thread_t *handle, void(* start_f)(void *), void *arg)
 {
     // Offer sacrifice to the machine spirit
@@ -73,23 +263,41 @@ int thread_create(thread_t *handle, void(* start_f)(void *), void *arg)
     __asm__ __volatile__ ("move %[a3], a3" : [a3] "=r" (a3));
     __asm__ __volatile__ ("move %[a4], a4" : [a4] "=r" (a4));
 
-    __asm__ __volatile__ ("move a4, a2");
-    __asm__ __volatile__ ("move a3, a1");
-    __asm__ __volatile__ ("move a2, a0");
+    __asm__ __volatile__ ("move a3, a2");
+    __asm__ __volatile__ ("move a2, a1");
+    __asm__ __volatile__ ("move a1, a0");
 
-    u64 new_stack = (u64)mem_alloc(DEFAULT_STACK_SIZE);
+    // Kernel provides the stack
+    __asm__ __volatile__ ("li a4, 0");
 
-    if(new_stack == 0ULL)
-        return THREAD_CREATE_NO_MEMORY;
+    __asm__ __volatile__ ("li a0, 0x11");
+    __asm__ __volatile__ ("ecall");
 
-    new_stack += DEFAULT_STACK_SIZE - 8;
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+    __asm__ __volatile__ ("move a3, %[a3]" : : [a3] "r" (a3));
+    __asm__ __volatile__ ("move a4, %[a4]" : : [a4] "r" (a4));
 
-    __asm__ __volatile__ ("move a1, a2");
-    __asm__ __volatile__ ("move a2, a3");
-    __asm__ __volatile__ ("move a3, a4");
-    __asm__ __volatile__ ("move a4, %[new_stack]" : : [new_stack] "r" (new_stack));
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
 
-    __asm__ __volatile__ ("li a0, 0x11");
+    return result;
+}
+
+int thread_create_ex(thread_t *handle, void(* start_f)(void *), void *arg, struct __thread_attr_t *attr)
+{
+    u64 a1, a2, a3, a4;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+    __asm__ __volatile__ ("move %[a3], a3" : [a3] "=r" (a3));
+    __asm__ __volatile__ ("move %[a4], a4" : [a4] "=r" (a4));
+
+    __asm__ __volatile__ ("move a4, a3");
+    __asm__ __volatile__ ("move a3, a2");
+    __asm__ __volatile__ ("move a2, a1");
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x14");
     __asm__ __volatile__ ("ecall");
 
     __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
@@ -100,14 +308,180 @@ int thread_create(thread_t *handle, void(* start_f)(void *), void *arg)
     int result;
     __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
 
-    if(result)
-        mem_free((void *)(new_stack - DEFAULT_STACK_SIZE + 8));
+    return result;
+}
+
+int thread_stack_usage(thread_t handle)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x15");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_set_priority(thread_t handle, unsigned int priority)
+{
+    u64 a1;
+    u64 a2;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+
+    __asm__ __volatile__ ("move a2, a1");
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x16");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_get_priority(thread_t handle)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x17");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_period_start(time_t period)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x18");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_period_wait()
+{
+    __asm__ __volatile__ ("li a0, 0x19");
+    __asm__ __volatile__ ("ecall");
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_period_stop(thread_t handle)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x1A");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_period_overruns(thread_t handle)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x1B");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_edf_start(time_t period, time_t budget, time_t deadline)
+{
+    u64 a1;
+    u64 a2;
+    u64 a3;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+    __asm__ __volatile__ ("move %[a2], a2" : [a2] "=r" (a2));
+    __asm__ __volatile__ ("move %[a3], a3" : [a3] "=r" (a3));
+
+    __asm__ __volatile__ ("move a3, a2");
+    __asm__ __volatile__ ("move a2, a1");
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x1C");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+    __asm__ __volatile__ ("move a2, %[a2]" : : [a2] "r" (a2));
+    __asm__ __volatile__ ("move a3, %[a3]" : : [a3] "r" (a3));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
+
+    return result;
+}
+
+int thread_edf_misses(thread_t handle)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x1D");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    int result;
+    __asm__ __volatile__ ("move %[result], a0" : [result] "=r" (result));
 
     return result;
 }
 
 int thread_exit()
 {
+    user_mem_thread_exit();
+
     __asm__ __volatile__ ("li a0, 0x12");
     __asm__ __volatile__ ("ecall");
 
@@ -235,6 +609,45 @@ int sem_trywait(sem_t handle)
     return res;
 }
 
+int mutex_open(sem_t *handle)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x27");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    i32 res;
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+
+    return res;
+}
+
+int mutex_lock_lazy(sem_t *handle)
+{
+    sem_t mutex = __atomic_load_n(handle, __ATOMIC_ACQUIRE);
+
+    if(mutex == 0ULL)
+    {
+        sem_t opened = 0ULL;
+
+        if(mutex_open(&opened))
+            return -1;
+
+        // Whoever lost the race drops its own mutex and uses the winner's
+        if(__atomic_compare_exchange_n(handle, &mutex, opened, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            mutex = opened;
+        else
+            sem_close(opened);
+    }
+
+    return sem_wait(mutex) < 0 ? -1 : 0;
+}
+
 int time_sleep(time_t time)
 {
     u64 a1;
@@ -252,3 +665,21 @@ int time_sleep(time_t time)
 
     return res;
 }
+
+int boot_stats(struct __boot_stats_t *stats)
+{
+    u64 a1;
+    __asm__ __volatile__ ("move %[a1], a1" : [a1] "=r" (a1));
+
+    __asm__ __volatile__ ("move a1, a0");
+
+    __asm__ __volatile__ ("li a0, 0x51");
+    __asm__ __volatile__ ("ecall");
+
+    __asm__ __volatile__ ("move a1, %[a1]" : : [a1] "r" (a1));
+
+    i32 res;
+    __asm__ __volatile__ ("move %[res], a0" : [res] "=r" (res));
+
+    return res;
+}
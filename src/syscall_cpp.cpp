@@ -22,8 +22,23 @@ void operator delete[](void *ptr) noexcept
 
 Thread::Thread(void(* body)(void *), void *arg)
 {
+    this->myHandle = 0;
     this->body = body;
     this->arg = arg;
+    this->attr = {};
+}
+
+Thread::Thread(void(* body)(void *), void *arg, const struct __thread_attr_t &attr)
+{
+    this->myHandle = 0;
+    this->body = body;
+    this->arg = arg;
+    this->attr = attr;
+}
+
+Thread::Thread(const struct __thread_attr_t &attr) : Thread()
+{
+    this->attr = attr;
 }
 
 Thread::Thread()
@@ -36,13 +51,54 @@ Thread::Thread()
         }
     };
 
+    this->myHandle = 0;
     this->body = (void (*)(void *))__hack::__func;
     this->arg = this;
+    this->attr = {};
 }
 
 int Thread::start()
 {
-    return thread_create(&this->myHandle, this->body, this->arg);
+    return thread_create_ex(&this->myHandle, this->body, this->arg, &this->attr);
+}
+
+int Thread::stackUsage()
+{
+    if(this->myHandle == 0)
+        return -1;
+
+    return thread_stack_usage(this->myHandle);
+}
+
+size_t Thread::liveBytes()
+{
+    if(this->myHandle == 0)
+        return 0;
+
+    return mem_live_bytes(this->myHandle);
+}
+
+int Thread::setPriority(unsigned priority)
+{
+    // Before start the thread is created with it, a null handle would mean the caller
+    if(this->myHandle == 0)
+    {
+        if(priority >= THREAD_PRIORITY_LEVELS)
+            return -1;
+
+        this->attr.priority = priority;
+        return 0;
+    }
+
+    return thread_set_priority(this->myHandle, priority);
+}
+
+int Thread::getPriority()
+{
+    if(this->myHandle == 0)
+        return this->attr.priority;
+
+    return thread_get_priority(this->myHandle);
 }
 
 void Thread::dispatch()
@@ -57,7 +113,7 @@ int Thread::sleep(time_t time)
 
 Thread::~Thread()
 {
-    delete this->myHandle;
+    // The handle belongs to the kernel and is reclaimed when the thread exits
 }
 
 Semaphore::Semaphore(unsigned init)
@@ -90,6 +146,168 @@ Semaphore::~Semaphore()
     sem_close(this->myHandle);
 }
 
+Mutex::Mutex()
+{
+    mutex_open(&this->myHandle);
+}
+
+int Mutex::lock()
+{
+    return sem_wait(this->myHandle);
+}
+
+int Mutex::unlock()
+{
+    return sem_signal(this->myHandle);
+}
+
+Mutex::~Mutex()
+{
+    sem_close(this->myHandle);
+}
+
+PeriodicThread::PeriodicThread(time_t period) : PeriodicThread(period, 0, 0)
+{
+}
+
+PeriodicThread::PeriodicThread(time_t period, time_t budget, time_t deadline) : Thread()
+{
+    this->period = period;
+    this->budget = budget;
+    this->deadline = deadline;
+}
+
+void PeriodicThread::run()
+{
+    int result = this->budget ? thread_edf_start(this->period, this->budget, this->deadline) : thread_period_start(this->period);
+
+    if(result)
+        return;
+
+    do
+        this->periodicActivation();
+    while(thread_period_wait() == 0);
+}
+
+void PeriodicThread::terminate()
+{
+    if(this->myHandle)
+        thread_period_stop(this->myHandle);
+}
+
+int PeriodicThread::overruns()
+{
+    if(this->myHandle == 0)
+        return 0;
+
+    return thread_period_overruns(this->myHandle);
+}
+
+int PeriodicThread::deadlineMisses()
+{
+    if(this->myHandle == 0)
+        return 0;
+
+    return thread_edf_misses(this->myHandle);
+}
+
+void *Memory::calloc(size_t count, size_t size)
+{
+    return mem_calloc(count, size);
+}
+
+void *Memory::realloc(void *ptr, size_t size)
+{
+    return mem_realloc(ptr, size);
+}
+
+int Memory::allocBatch(size_t count, size_t size, void *out[])
+{
+    return mem_alloc_batch(count, size, out);
+}
+
+int Memory::freeBatch(void *ptrs[], size_t count)
+{
+    return mem_free_batch(ptrs, count);
+}
+
+int Memory::stats(struct __mem_stats_t *stats, unsigned heap)
+{
+    return mem_stats(stats, heap);
+}
+
+Arena::Arena(size_t chunkSize)
+{
+    this->chunks = 0;
+    this->current = 0;
+    this->end = 0;
+    this->chunkSize = chunkSize;
+    this->chunkBytes = 0;
+}
+
+void *Arena::grow(size_t size, size_t align)
+{
+    size_t limit = (size_t)-1 - sizeof(Chunk) - chunkOverhead - MEM_BLOCK_SIZE;
+
+    // Anything bigger would wrap around in the sums below
+    if(align > limit || size > limit - align || this->chunkSize > limit)
+        return 0;
+
+    size_t needed = sizeof(Chunk) + size + align;
+    size_t bytes = needed > this->chunkSize ? needed : this->chunkSize;
+
+    // Chunks too big for a small slot get whole blocks from the kernel, the rounding up is free
+    if(bytes + sizeof(struct __user_mem_header_t) > USER_MEM_MAX_SLOT)
+        bytes = (bytes + chunkOverhead + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE * MEM_BLOCK_SIZE - chunkOverhead;
+
+    Chunk *chunk = (Chunk *)mem_alloc(bytes);
+    if(chunk == 0)
+        return 0;
+
+    chunk->next = this->chunks;
+    chunk->size = bytes;
+
+    this->chunks = chunk;
+    this->chunkBytes += bytes;
+    this->current = (char *)(chunk + 1);
+    this->end = (char *)chunk + bytes;
+
+    return alloc(size, align);
+}
+
+void Arena::reset()
+{
+    if(this->chunks == 0)
+        return;
+
+    // The oldest chunk is the last one in the list
+    while(this->chunks->next)
+    {
+        Chunk *next = this->chunks->next;
+        mem_free(this->chunks);
+        this->chunks = next;
+    }
+
+    this->chunkBytes = this->chunks->size;
+    this->current = (char *)(this->chunks + 1);
+    this->end = (char *)this->chunks + this->chunks->size;
+}
+
+Arena::~Arena()
+{
+    while(this->chunks)
+    {
+        Chunk *next = this->chunks->next;
+        mem_free(this->chunks);
+        this->chunks = next;
+    }
+}
+
+size_t Memory::liveBytes()
+{
+    return mem_live_bytes(0);
+}
+
 char Console::getc()
 {
     return ::getc();
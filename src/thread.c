@@ -2,36 +2,215 @@
 #include "../h/thread.h"
 #include "../h/mem.h"
 #include "../h/kernel.h"
+#include "../h/user_mem.h"
 
 enum THREAD_CREATE_ERRORS
 {
     THREAD_CREATE_NO_MEMORY = -1,
+    THREAD_CREATE_INVALID_ATTR = -2,
 };
 
-void __thread_wrapper(void(* start_f)(void *), void *arg)
+struct __slab_cache_t thread_cache;
+
+list_t *threads_recycled = 0ULL;
+u64 threads_recycled_cnt = 0;
+
+void __thread_init()
+{
+    __slab_init(&thread_cache, "Threads", sizeof(struct __thread_t));
+}
+
+// Runs in the mode of the new thread, the user allocator keeps its per-thread state in tp
+void __thread_wrapper(void(* start_f)(void *), void *arg, u64 flags)
 {
+    user_mem_thread_start(flags);
+
     start_f(arg);
 
+    user_mem_thread_exit();
+
     ASM("li a0, 0x12");
     ASM("ecall");
 }
 
-int __thread_create(thread_t *handle, void(* start_f)(void *), void *arg, void *stack_space, enum EXEC_MODE mode)
+void __thread_recycled_push(thread_t thread)
+{
+    threads_recycled_cnt++;
+
+    if(threads_recycled == 0ULL)
+    {
+        thread->list_node.next = &(thread->list_node);
+        thread->list_node.prev = &(thread->list_node);
+        threads_recycled = &(thread->list_node);
+
+        return;
+    }
+
+    list_insert(threads_recycled, &(thread->list_node));
+}
+
+thread_t __thread_recycled_pop()
+{
+    if(threads_recycled == 0ULL)
+        return 0ULL;
+
+    threads_recycled_cnt--;
+
+    thread_t thread = container_of(threads_recycled, struct __thread_t, list_node);
+
+    if(threads_recycled->next == threads_recycled)
+    {
+        threads_recycled = 0ULL;
+        return thread;
+    }
+
+    threads_recycled->prev->next = threads_recycled->next;
+    threads_recycled->next->prev = threads_recycled->prev;
+    threads_recycled = threads_recycled->next;
+
+    return thread;
+}
+
+// Null stack_space means the kernel provides the stack, reusing an exited thread's if the size matches
+thread_t __thread_alloc(void **stack_space, u64 stack_size)
+{
+    if(*stack_space)
+        return __slab_alloc(&thread_cache);
+
+    thread_t new_thread = stack_size == DEFAULT_STACK_SIZE ? __thread_recycled_pop() : 0ULL;
+
+    if(new_thread == 0ULL)
+    {
+        new_thread = __slab_alloc(&thread_cache);
+
+        if(new_thread == 0ULL)
+            return 0ULL;
+
+        void *stack = __mem_alloc(&user_heap, stack_size / MEM_BLOCK_SIZE);
+
+        if(stack == 0ULL)
+        {
+            __slab_free(&thread_cache, new_thread);
+            return 0ULL;
+        }
+
+        new_thread->bp = (u64)stack;
+    }
+
+    *stack_space = (void *)(new_thread->bp + stack_size - 8ULL);
+
+    return new_thread;
+}
+
+#ifdef THREAD_STACK_PAINT
+void __thread_stack_paint(thread_t thread)
+{
+    for(u64 *word = (u64 *)thread->bp; word < (u64 *)thread->sp; word++)
+        *word = THREAD_STACK_PAINT_WORD;
+}
+
+void __thread_stack_check(thread_t thread)
+{
+    if(thread->stack_size && *(u64 *)thread->bp != THREAD_STACK_PAINT_WORD)
+        __panic("Stack overflow\n");
+}
+#endif
+
+// Deepest the stack has been in bytes, -1 if stacks are not painted
+i64 __thread_stack_high_water(thread_t thread)
+{
+#ifdef THREAD_STACK_PAINT
+    // Kernel main runs on the boot stack
+    if(thread->stack_size == 0)
+        return -1;
+
+    u64 *word = (u64 *)thread->bp;
+    u64 *top = (u64 *)(thread->bp + thread->stack_size);
+
+    while(word < top && *word == THREAD_STACK_PAINT_WORD)
+        word++;
+
+    return (u64)top - (u64)word;
+#else
+    return -1;
+#endif
+}
+
+int __thread_create(thread_t *handle, void(* start_f)(void *), void *arg, void *stack_space, enum EXEC_MODE mode, struct __thread_attr_t *attr)
 {
-    size_t thread_size_in_blocks = (sizeof(struct __thread_t) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
-    thread_t new_thread = __mem_alloc(thread_size_in_blocks);
+    u64 stack_size = DEFAULT_STACK_SIZE;
+    time_t time_slice = DEFAULT_TIME_SLICE;
+    u32 priority = 0;
+    u32 flags = 0;
+
+    if(attr)
+    {
+        // Only kernel provided stacks can be sized
+        if(attr->stack_size && (stack_space || attr->stack_size < THREAD_MIN_STACK_SIZE))
+            return THREAD_CREATE_INVALID_ATTR;
+
+        if(attr->priority >= THREAD_PRIORITY_LEVELS)
+            return THREAD_CREATE_INVALID_ATTR;
+
+        if(attr->stack_size)
+            stack_size = (attr->stack_size + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE * MEM_BLOCK_SIZE;
+
+        if(attr->time_slice)
+            time_slice = attr->time_slice;
+
+        priority = attr->priority;
+        flags = attr->flags;
+    }
+
+    u32 stack_owned = stack_space == 0ULL;
+    thread_t new_thread = __thread_alloc(&stack_space, stack_size);
 
     if(new_thread == 0ULL)
         return THREAD_CREATE_NO_MEMORY;
 
+    new_thread->stack_size = stack_size;
+    new_thread->stack_owned = stack_owned;
+    new_thread->time_slice = time_slice;
+    new_thread->priority = priority;
+#ifdef SCHEDULER_MLFQ
+    // Start on top, the feedback lets it sink down to its priority
+    new_thread->level = THREAD_PRIORITY_LEVELS - 1;
+#else
+    new_thread->level = priority;
+#endif
+    new_thread->flags = flags;
+    new_thread->ready = 0;
+
+    new_thread->timer.slot = 0ULL;
+    new_thread->periodic.period = 0ULL;
+    new_thread->periodic.overruns = 0ULL;
+    new_thread->periodic.waiting = 0;
+    new_thread->periodic.terminated = 0;
+    new_thread->base_level = new_thread->level;
+    new_thread->boosted = 0;
+    new_thread->held_mutexes = 0ULL;
+    new_thread->blocked_on = 0ULL;
+    new_thread->edf.budget = 0ULL;
+    new_thread->edf.density = 0ULL;
+    new_thread->edf.misses = 0ULL;
+    new_thread->edf.spilled = 0;
+    new_thread->owned_mem = 0ULL;
+    new_thread->owned_bytes = 0;
+    new_thread->mem_slots = 0ULL;
+
     new_thread->sp = (u64)stack_space;
-    new_thread->bp = (u64)stack_space - DEFAULT_STACK_SIZE + 8ULL;
-    new_thread->time_left = DEFAULT_TIME_SLICE;
+    new_thread->bp = (u64)stack_space - stack_size + 8ULL;
+    new_thread->time_left = time_slice;
 
     new_thread->sp -= 0x100;
     ((context_t)new_thread->sp)->sp = new_thread->sp;
     ((context_t)new_thread->sp)->a0 = (u64)start_f;
     ((context_t)new_thread->sp)->a1 = (u64)arg;
+    ((context_t)new_thread->sp)->a2 = flags;
+
+#ifdef THREAD_STACK_PAINT
+    __thread_stack_paint(new_thread);
+#endif
 
     __debug_mem("new thread bp", new_thread->bp);
     __debug_mem("new thread sp", new_thread->sp);
@@ -81,6 +260,11 @@ void yield(thread_t thread_old, thread_t thread_new)
     __debug_mem("old thread", (u64)thread_old);
     __debug_mem("new thread", (u64)thread_new);
 
+#ifdef THREAD_STACK_PAINT
+    // Catches an overflow while the block below the stack is still mostly intact
+    __thread_stack_check(thread_old);
+#endif
+
     if(thread_old == thread_new)
     {
         thread_t thread_current = thread_old;
@@ -134,10 +318,25 @@ void __thread_delete(thread_t thread)
     if(thread->sp < thread->bp)
         __panic("Stack overflow\n");
 
-    if(__mem_free((void *)thread->bp))
+    __thread_mem_release(thread);
+
+#ifdef THREAD_STACK_PAINT
+    __print_mem("Exited thread", (u64)thread);
+    __print_mem("Stack high water", __thread_stack_high_water(thread));
+    __print_mem("Stack size", thread->stack_size);
+#endif
+
+    // A stack the creator passed in stays theirs, it is neither handed to another thread nor freed
+    if(thread->stack_owned && thread->stack_size == DEFAULT_STACK_SIZE && threads_recycled_cnt < THREAD_RECYCLE_MAX)
+    {
+        __thread_recycled_push(thread);
+        return;
+    }
+
+    if(thread->stack_owned && __mem_free(&user_heap, (void *)thread->bp))
         __panic("Failed to free thread stack, memory corruption\n");
 
-    if(__mem_free((void *)thread))
+    if(__slab_free(&thread_cache, (void *)thread))
        __panic("Failed to free thread, memory corruption\n");
 
     return;
@@ -153,6 +352,9 @@ void __thread_exit()
 
     __debug_str("Exited thread\n");
     thread_t thread_current = __scheduler_current();
+    __scheduler_edf_leave(thread_current);
+    __sem_abandon(thread_current);
+
     thread_t thread_next = __scheduler_next();
 
     yield(thread_current, thread_next);
@@ -160,3 +362,246 @@ void __thread_exit()
 
     return;
 }
+
+void __thread_mem_link(struct __thread_mem_header_t *header, thread_t owner)
+{
+    header->owner = owner;
+    header->magic = THREAD_MEM_MAGIC;
+
+    if(owner == 0ULL)
+        return;
+
+    if(owner->owned_mem == 0ULL)
+    {
+        header->owner_node.next = &(header->owner_node);
+        header->owner_node.prev = &(header->owner_node);
+    }
+    else
+        list_insert(owner->owned_mem, &(header->owner_node));
+
+    owner->owned_mem = &(header->owner_node);
+}
+
+void __thread_mem_unlink(struct __thread_mem_header_t *header)
+{
+    thread_t owner = header->owner;
+
+    if(owner == 0ULL)
+        return;
+
+    if(header->owner_node.next == &(header->owner_node))
+    {
+        owner->owned_mem = 0ULL;
+        return;
+    }
+
+    header->owner_node.prev->next = header->owner_node.next;
+    header->owner_node.next->prev = header->owner_node.prev;
+
+    if(owner->owned_mem == &(header->owner_node))
+        owner->owned_mem = header->owner_node.next;
+}
+
+// Header of an allocation handed out by __thread_mem_alloc, or one of FREE_ERRORS
+i64 __thread_mem_header(void *ptr)
+{
+    u64 abs_ptr = (u64)ptr;
+
+    if(abs_ptr < (u64)user_heap.start + sizeof(struct __thread_mem_header_t) || abs_ptr >= (u64)user_heap.end)
+        return FREE_OUT_OF_HEAP;
+
+    struct __thread_mem_header_t *header = (struct __thread_mem_header_t *)ptr - 1;
+
+    if(((u64)header - (u64)user_heap.start) % MEM_BLOCK_SIZE)
+        return FREE_NOT_BLOCK_ALLIGNED;
+
+    if(header->magic != THREAD_MEM_MAGIC)
+        return FREE_NOT_ALLOCED;
+
+    i64 entry = __mem_alloc_entry(&user_heap, header);
+
+    if(entry < 0)
+        return entry;
+
+    return (i64)header;
+}
+
+// Blocks that hold nbytes behind the header, 0 if that does not fit in a size_t
+size_t __thread_mem_blocks(size_t nbytes)
+{
+    if(nbytes == 0 || nbytes > THREAD_MEM_MAX_BYTES)
+        return 0;
+
+    return (nbytes + sizeof(struct __thread_mem_header_t) + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+}
+
+// What the owner gets to use out of a run, its blocks less the header
+u64 __thread_mem_usable(size_t nblocks)
+{
+    return nblocks * MEM_BLOCK_SIZE - sizeof(struct __thread_mem_header_t);
+}
+
+void *__thread_mem_alloc(thread_t owner, size_t nbytes)
+{
+    size_t nblocks = __thread_mem_blocks(nbytes);
+
+    if(nblocks == 0)
+        return 0ULL;
+
+    struct __thread_mem_header_t *header = __mem_alloc(&user_heap, nblocks);
+
+    if(header == 0ULL)
+        return 0ULL;
+
+    __thread_mem_link(header, owner);
+
+    if(owner)
+        owner->owned_bytes += __thread_mem_usable(nblocks);
+
+    return header + 1;
+}
+
+void *__thread_mem_calloc(thread_t owner, size_t nbytes)
+{
+    size_t nblocks = __thread_mem_blocks(nbytes);
+
+    if(nblocks == 0)
+        return 0ULL;
+
+    struct __thread_mem_header_t *header = __mem_calloc(&user_heap, nblocks);
+
+    if(header == 0ULL)
+        return 0ULL;
+
+    __thread_mem_link(header, owner);
+
+    if(owner)
+        owner->owned_bytes += __thread_mem_usable(nblocks);
+
+    return header + 1;
+}
+
+int __thread_mem_free(void *ptr)
+{
+    i64 result = __thread_mem_header(ptr);
+
+    if(result < 0)
+        return result;
+
+    struct __thread_mem_header_t *header = (struct __thread_mem_header_t *)result;
+
+    __thread_mem_unlink(header);
+
+    if(header->owner)
+        header->owner->owned_bytes -= __thread_mem_usable(__mem_size(&user_heap, header));
+
+    // The header turns into free run bookkeeping, a second free must not recognise it
+    header->magic = 0ULL;
+
+    return __mem_free(&user_heap, header);
+}
+
+// Ownership stays with the original owner even when another thread resizes it
+void *__thread_mem_realloc(void *ptr, size_t nbytes)
+{
+    i64 result = __thread_mem_header(ptr);
+
+    if(result < 0)
+        return 0ULL;
+
+    if(nbytes == 0)
+    {
+        __thread_mem_free(ptr);
+        return 0ULL;
+    }
+
+    size_t nblocks = __thread_mem_blocks(nbytes);
+
+    // The old allocation stays as it is
+    if(nblocks == 0)
+        return 0ULL;
+
+    struct __thread_mem_header_t *header = (struct __thread_mem_header_t *)result;
+    thread_t owner = header->owner;
+    u64 old_nblocks = __mem_size(&user_heap, header);
+
+    // A move copies the header too, it has to leave the owner list before its old copy is freed
+    __thread_mem_unlink(header);
+    header->magic = 0ULL;
+
+    struct __thread_mem_header_t *new_header = __mem_realloc(&user_heap, header, nblocks);
+
+    if(new_header == 0ULL)
+    {
+        __thread_mem_link(header, owner);
+        return 0ULL;
+    }
+
+    __thread_mem_link(new_header, owner);
+
+    if(owner)
+        owner->owned_bytes = owner->owned_bytes - __thread_mem_usable(old_nblocks) + __thread_mem_usable(nblocks);
+
+    return new_header + 1;
+}
+
+size_t __thread_mem_alloc_batch(thread_t owner, size_t count, size_t nbytes, void **out)
+{
+    size_t nblocks = __thread_mem_blocks(nbytes);
+    size_t done = __mem_alloc_batch(&user_heap, count, nblocks, out);
+
+    for(u64 i = 0; i < done; i++)
+    {
+        __thread_mem_link(out[i], owner);
+        out[i] = (struct __thread_mem_header_t *)out[i] + 1;
+    }
+
+    if(owner)
+        owner->owned_bytes += done * __thread_mem_usable(nblocks);
+
+    return done;
+}
+
+// Freed entries are cleared, the ones left behind failed, null entries are skipped
+size_t __thread_mem_free_batch(void **ptrs, size_t count)
+{
+    size_t failed = 0;
+
+    for(u64 i = 0; i < count; i++)
+    {
+        if(ptrs[i] == 0ULL)
+            continue;
+
+        if(__thread_mem_free(ptrs[i]))
+        {
+            failed++;
+            continue;
+        }
+
+        ptrs[i] = 0ULL;
+    }
+
+    return failed;
+}
+
+// Frees what an exiting thread still owns if it asked for it, otherwise the memory becomes shared
+void __thread_mem_release(thread_t thread)
+{
+    while(thread->owned_mem)
+    {
+        struct __thread_mem_header_t *header = (struct __thread_mem_header_t *)thread->owned_mem;
+
+        __thread_mem_unlink(header);
+
+        if(thread->flags & THREAD_ATTR_RECLAIM)
+        {
+            header->magic = 0ULL;
+            __mem_free(&user_heap, header);
+        }
+        else
+            header->owner = 0ULL;
+    }
+
+    thread->owned_bytes = 0;
+    thread->mem_slots = 0ULL;
+}
@@ -0,0 +1,506 @@
+#include "../h/user_mem.h"
+#include "../h/syscall_c.h"
+
+// Arenas of threads that exited without THREAD_ATTR_RECLAIM, their slots may still be in use elsewhere
+struct __user_mem_arena_t *user_mem_orphans = 0ULL;
+
+// A holder preempted inside the allocator runs at the level of its most urgent waiter until it lets go
+sem_t user_mem_mutex = 0ULL;
+
+// Fails only while the mutex could not be opened yet, never once a slot or an arena exists
+int user_mem_lock()
+{
+    return mutex_lock_lazy(&user_mem_mutex);
+}
+
+void user_mem_unlock()
+{
+    sem_signal(user_mem_mutex);
+}
+
+// The kernel never touches tp, every thread starts with its own
+u64 user_mem_tp()
+{
+    u64 tp;
+    __asm__ __volatile__ ("move %[tp], tp" : [tp] "=r" (tp));
+    return tp;
+}
+
+void user_mem_tp_set(u64 tp)
+{
+    __asm__ __volatile__ ("move tp, %[tp]" : : [tp] "r" (tp));
+}
+
+void user_mem_thread_start(u64 flags)
+{
+    user_mem_tp_set((flags & THREAD_ATTR_RECLAIM) ? USER_MEM_TP_RECLAIM : 0ULL);
+}
+
+void user_mem_thread_exit()
+{
+    u64 tp = user_mem_tp();
+    struct __user_mem_arena_t *arena = (struct __user_mem_arena_t *)(tp & ~USER_MEM_TP_RECLAIM);
+
+    // A reclaiming thread takes its chunks down with it, arena included
+    if(arena == 0ULL || (tp & USER_MEM_TP_RECLAIM))
+        return;
+
+    user_mem_lock();
+    arena->next_orphan = user_mem_orphans;
+    user_mem_orphans = arena;
+    user_mem_unlock();
+
+    user_mem_tp_set(0ULL);
+}
+
+// Chunks fill whole blocks together with the kernel's header in front of them
+u64 user_mem_chunk_bytes(u64 nblocks)
+{
+    return nblocks * MEM_BLOCK_SIZE - sizeof(struct __thread_mem_header_t);
+}
+
+struct __user_mem_chunk_t *user_mem_chunk_alloc(struct __user_mem_arena_t *arena, u64 nblocks)
+{
+    struct __user_mem_chunk_t *chunk = mem_alloc_raw(user_mem_chunk_bytes(nblocks));
+
+    if(chunk == 0ULL)
+        return 0ULL;
+
+    chunk->arena = arena;
+
+    if(arena)
+        arena->slots.chunk_bytes += user_mem_chunk_bytes(nblocks);
+
+    return chunk;
+}
+
+void user_mem_chunk_use(struct __user_mem_arena_t *arena, struct __user_mem_chunk_t *chunk, char *next, u64 nblocks)
+{
+    arena->chunk = chunk;
+    arena->chunk_next = next;
+    arena->chunk_end = (char *)chunk + user_mem_chunk_bytes(nblocks);
+}
+
+// Called with the lock held, creates the arena on the first small allocation of the thread
+struct __user_mem_arena_t *user_mem_arena()
+{
+    u64 tp = user_mem_tp();
+    struct __user_mem_arena_t *arena = (struct __user_mem_arena_t *)(tp & ~USER_MEM_TP_RECLAIM);
+
+    if(arena)
+        return arena;
+
+    // An orphan would go down with a reclaiming thread together with slots other threads still hold
+    if(user_mem_orphans && !(tp & USER_MEM_TP_RECLAIM))
+    {
+        arena = user_mem_orphans;
+        user_mem_orphans = arena->next_orphan;
+        arena->next_orphan = 0ULL;
+
+        // Its chunks went shared when their thread exited, the slots still out are charged here until they come back
+        arena->slots.chunk_bytes = 0;
+        mem_slots_raw(&(arena->slots));
+
+        user_mem_tp_set((u64)arena);
+
+        return arena;
+    }
+
+    struct __user_mem_chunk_t *chunk = user_mem_chunk_alloc(0ULL, USER_MEM_CHUNK_MIN_BLOCKS);
+
+    if(chunk == 0ULL)
+        return 0ULL;
+
+    arena = (struct __user_mem_arena_t *)((char *)chunk + USER_MEM_MIN_SLOT);
+    chunk->arena = arena;
+
+    for(u32 class = 0; class < USER_MEM_CLASS_COUNT; class++)
+        arena->free_slots[class] = 0ULL;
+
+    u64 arena_size = (sizeof(struct __user_mem_arena_t) + USER_MEM_MIN_SLOT - 1) / USER_MEM_MIN_SLOT * USER_MEM_MIN_SLOT;
+
+    user_mem_chunk_use(arena, chunk, (char *)arena + arena_size, USER_MEM_CHUNK_MIN_BLOCKS);
+    arena->chunk_blocks = 2 * USER_MEM_CHUNK_MIN_BLOCKS;
+    arena->next_orphan = 0ULL;
+    arena->slots.chunk_bytes = user_mem_chunk_bytes(USER_MEM_CHUNK_MIN_BLOCKS);
+    arena->slots.slot_bytes = 0;
+    mem_slots_raw(&(arena->slots));
+
+    user_mem_tp_set((u64)arena | (tp & USER_MEM_TP_RECLAIM));
+
+    return arena;
+}
+
+void user_mem_push_slot(struct __user_mem_arena_t *arena, u32 class, struct __user_mem_header_t *slot)
+{
+    // Link lives past the header so a freed slot keeps its magic
+    *(void **)(slot + 1) = arena->free_slots[class];
+    arena->free_slots[class] = slot;
+}
+
+struct __user_mem_header_t *user_mem_pop_slot(struct __user_mem_arena_t *arena, u32 class)
+{
+    struct __user_mem_header_t *slot = arena->free_slots[class];
+
+    if(slot)
+        arena->free_slots[class] = *(void **)(slot + 1);
+
+    return slot;
+}
+
+// Slots keep their chunk offset and class from here on, a free only rewrites the magic
+struct __user_mem_header_t *user_mem_slot_init(struct __user_mem_arena_t *arena, u32 class)
+{
+    struct __user_mem_header_t *slot = (struct __user_mem_header_t *)arena->chunk_next;
+
+    slot->size_class = class;
+    slot->chunk_offset = (arena->chunk_next - (char *)arena->chunk) / USER_MEM_MIN_SLOT;
+    arena->chunk_next += USER_MEM_MIN_SLOT << class;
+
+    return slot;
+}
+
+// Hands out the tail of the current chunk to the classes before it is replaced
+void user_mem_retire_chunk(struct __user_mem_arena_t *arena)
+{
+    for(u32 class = USER_MEM_CLASS_COUNT; class > 0; class--)
+    {
+        u64 slot_size = USER_MEM_MIN_SLOT << (class - 1);
+
+        while(arena->chunk_end - arena->chunk_next >= slot_size)
+            user_mem_push_slot(arena, class - 1, user_mem_slot_init(arena, class - 1));
+    }
+}
+
+struct __user_mem_header_t *user_mem_carve(struct __user_mem_arena_t *arena, u32 class)
+{
+    u64 slot_size = USER_MEM_MIN_SLOT << class;
+
+    if(arena->chunk_end - arena->chunk_next < slot_size)
+    {
+        u64 nblocks = arena->chunk_blocks;
+
+        while(user_mem_chunk_bytes(nblocks) - USER_MEM_MIN_SLOT < slot_size)
+            nblocks *= 2;
+
+        struct __user_mem_chunk_t *chunk = user_mem_chunk_alloc(arena, nblocks);
+
+        if(chunk == 0ULL)
+            return 0ULL;
+
+        user_mem_retire_chunk(arena);
+        user_mem_chunk_use(arena, chunk, (char *)chunk + USER_MEM_MIN_SLOT, nblocks);
+
+        if(nblocks < USER_MEM_CHUNK_BLOCKS)
+            arena->chunk_blocks = nblocks * 2;
+    }
+
+    return user_mem_slot_init(arena, class);
+}
+
+struct __user_mem_chunk_t *user_mem_slot_chunk(struct __user_mem_header_t *slot)
+{
+    return (struct __user_mem_chunk_t *)((char *)slot - slot->chunk_offset * USER_MEM_MIN_SLOT);
+}
+
+u64 user_mem_slot_bytes(u32 class)
+{
+    return (USER_MEM_MIN_SLOT << class) - sizeof(struct __user_mem_header_t);
+}
+
+// Called with the lock held
+struct __user_mem_header_t *user_mem_take_slot(u32 class)
+{
+    struct __user_mem_arena_t *arena = user_mem_arena();
+
+    if(arena == 0ULL)
+        return 0ULL;
+
+    struct __user_mem_header_t *header = user_mem_pop_slot(arena, class);
+
+    if(header == 0ULL)
+        header = user_mem_carve(arena, class);
+
+    if(header)
+        arena->slots.slot_bytes += user_mem_slot_bytes(class);
+
+    return header;
+}
+
+// Called with the lock held, goes back to the thread that carved it or to whoever took its arena over
+void user_mem_give_slot(struct __user_mem_header_t *slot)
+{
+    struct __user_mem_chunk_t *chunk = user_mem_slot_chunk(slot);
+
+    chunk->arena->slots.slot_bytes -= user_mem_slot_bytes(slot->size_class);
+
+    user_mem_push_slot(chunk->arena, slot->size_class, slot);
+}
+
+void *user_mem_alloc_large(size_t nbytes)
+{
+    struct __user_mem_header_t *header = mem_alloc_raw(nbytes + sizeof(struct __user_mem_header_t));
+
+    if(header == 0ULL)
+        return 0ULL;
+
+    header->magic = USER_MEM_MAGIC;
+    header->size_class = USER_MEM_CLASS_LARGE;
+
+    return header + 1;
+}
+
+void *user_mem_alloc(size_t nbytes)
+{
+    if(nbytes > USER_MEM_MAX_BYTES)
+        return 0ULL;
+
+    size_t slot_size = nbytes + sizeof(struct __user_mem_header_t);
+
+    if(slot_size > USER_MEM_MAX_SLOT)
+        return user_mem_alloc_large(nbytes);
+
+    u32 class = 0;
+    while((USER_MEM_MIN_SLOT << class) < slot_size)
+        class++;
+
+    if(user_mem_lock())
+        return user_mem_alloc_large(nbytes);
+
+    struct __user_mem_header_t *header = user_mem_take_slot(class);
+    user_mem_unlock();
+
+    // Kernel heap is too fragmented for a new chunk, try an exact fit
+    if(header == 0ULL)
+        return user_mem_alloc_large(nbytes);
+
+    header->magic = USER_MEM_MAGIC;
+
+    return header + 1;
+}
+
+// Small slots are cheap to clear here, large ones come zeroed from the kernel
+void *user_mem_calloc(size_t nbytes)
+{
+    if(nbytes > USER_MEM_MAX_BYTES)
+        return 0ULL;
+
+    size_t slot_size = nbytes + sizeof(struct __user_mem_header_t);
+
+    if(slot_size > USER_MEM_MAX_SLOT)
+    {
+        struct __user_mem_header_t *header = mem_calloc_raw(slot_size);
+
+        if(header == 0ULL)
+            return 0ULL;
+
+        header->magic = USER_MEM_MAGIC;
+        header->size_class = USER_MEM_CLASS_LARGE;
+
+        return header + 1;
+    }
+
+    u64 *ptr = user_mem_alloc(nbytes);
+
+    if(ptr == 0ULL)
+        return 0ULL;
+
+    for(u64 i = 0; i < (nbytes + sizeof(u64) - 1) / sizeof(u64); i++)
+        ptr[i] = 0ULL;
+
+    return ptr;
+}
+
+int user_mem_free(void *ptr)
+{
+    // Let the kernel validate anything that did not come from here
+    if((u64)ptr < (u64)HEAP_START_ADDR + sizeof(struct __user_mem_header_t) || (u64)ptr >= (u64)HEAP_END_ADDR)
+        return mem_free_raw(ptr);
+
+    struct __user_mem_header_t *header = (struct __user_mem_header_t *)ptr - 1;
+
+    if(header->magic != USER_MEM_MAGIC)
+        return mem_free_raw(ptr);
+
+    header->magic = USER_MEM_FREED;
+
+    if(header->size_class == USER_MEM_CLASS_LARGE)
+        return mem_free_raw(header);
+
+    user_mem_lock();
+    user_mem_give_slot(header);
+    user_mem_unlock();
+
+    return 0;
+}
+
+void *user_mem_realloc(void *ptr, size_t nbytes)
+{
+    if(ptr == 0ULL)
+        return user_mem_alloc(nbytes);
+
+    // The old allocation stays as it is
+    if(nbytes > USER_MEM_MAX_BYTES)
+        return 0ULL;
+
+    // Raw allocations are resized by the kernel as they are
+    if((u64)ptr < (u64)HEAP_START_ADDR + sizeof(struct __user_mem_header_t) || (u64)ptr >= (u64)HEAP_END_ADDR)
+        return mem_realloc_raw(ptr, nbytes);
+
+    struct __user_mem_header_t *header = (struct __user_mem_header_t *)ptr - 1;
+
+    if(header->magic != USER_MEM_MAGIC)
+        return mem_realloc_raw(ptr, nbytes);
+
+    size_t slot_size = nbytes + sizeof(struct __user_mem_header_t);
+
+    // The kernel grows or trims large ones in place when the neighbouring run allows it
+    if(header->size_class == USER_MEM_CLASS_LARGE)
+    {
+        header = mem_realloc_raw(header, slot_size);
+
+        return header ? header + 1 : 0ULL;
+    }
+
+    size_t old_slot_size = USER_MEM_MIN_SLOT << header->size_class;
+
+    if(slot_size <= old_slot_size)
+        return ptr;
+
+    char *new_ptr = user_mem_alloc(nbytes);
+
+    if(new_ptr == 0ULL)
+        return 0ULL;
+
+    for(u64 i = 0; i < old_slot_size - sizeof(struct __user_mem_header_t); i++)
+        new_ptr[i] = ((char *)ptr)[i];
+
+    user_mem_free(ptr);
+
+    return new_ptr;
+}
+
+int user_mem_alloc_batch(size_t count, size_t nbytes, void **out)
+{
+    if(nbytes > USER_MEM_MAX_BYTES)
+    {
+        for(u64 i = 0; i < count; i++)
+            out[i] = 0ULL;
+
+        return 0;
+    }
+
+    size_t slot_size = nbytes + sizeof(struct __user_mem_header_t);
+    size_t done = 0;
+
+    // Without the mutex the kernel serves the whole batch, with it the small path below runs locked
+    if(slot_size > USER_MEM_MAX_SLOT || user_mem_lock())
+    {
+        done = mem_alloc_raw_batch(count, slot_size, out);
+
+        for(u64 i = 0; i < done; i++)
+        {
+            struct __user_mem_header_t *header = out[i];
+
+            header->magic = USER_MEM_MAGIC;
+            header->size_class = USER_MEM_CLASS_LARGE;
+            out[i] = header + 1;
+        }
+
+        return done;
+    }
+
+    u32 class = 0;
+    while((USER_MEM_MIN_SLOT << class) < slot_size)
+        class++;
+
+    for(u64 i = 0; i < count; i++)
+    {
+        struct __user_mem_header_t *header = user_mem_take_slot(class);
+
+        out[i] = 0ULL;
+
+        if(header == 0ULL)
+            continue;
+
+        header->magic = USER_MEM_MAGIC;
+        out[i] = header + 1;
+        done++;
+    }
+
+    user_mem_unlock();
+
+    return done;
+}
+
+int user_mem_free_batch(void **ptrs, size_t count)
+{
+    size_t failed = 0;
+
+    for(u64 base = 0; base < count; base += USER_MEM_FREE_BATCH)
+    {
+        size_t batch = count - base < USER_MEM_FREE_BATCH ? count - base : USER_MEM_FREE_BATCH;
+        void **group = ptrs + base;
+
+        // Entries handed to the kernel as a header pointer instead of the user one
+        u64 large = 0;
+        u64 to_kernel = 0;
+
+        user_mem_lock();
+
+        for(u64 i = 0; i < batch; i++)
+        {
+            u64 ptr = (u64)group[i];
+
+            if(ptr == 0ULL)
+                continue;
+
+            if(ptr < (u64)HEAP_START_ADDR + sizeof(struct __user_mem_header_t) || ptr >= (u64)HEAP_END_ADDR)
+            {
+                to_kernel++;
+                continue;
+            }
+
+            struct __user_mem_header_t *header = (struct __user_mem_header_t *)ptr - 1;
+
+            if(header->magic != USER_MEM_MAGIC)
+            {
+                to_kernel++;
+                continue;
+            }
+
+            header->magic = USER_MEM_FREED;
+
+            if(header->size_class == USER_MEM_CLASS_LARGE)
+            {
+                group[i] = header;
+                large |= 1ULL << i;
+                to_kernel++;
+                continue;
+            }
+
+            user_mem_give_slot(header);
+            group[i] = 0ULL;
+        }
+
+        user_mem_unlock();
+
+        if(to_kernel == 0)
+            continue;
+
+        failed += mem_free_raw_batch(group, batch);
+
+        for(u64 i = 0; i < batch; i++)
+        {
+            if(group[i] == 0ULL || !(large & (1ULL << i)))
+                continue;
+
+            struct __user_mem_header_t *header = group[i];
+
+            header->magic = USER_MEM_MAGIC;
+            group[i] = header + 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,94 @@
+#include "../h/syscall_cpp.hpp"
+#include "../h/user_mem.h"
+#include "Arena_test.hpp"
+
+#include "printing.hpp"
+
+static const int objects = 1000;
+
+// A default chunk takes exactly 64 blocks, live bytes leave out only the kernel's header
+static const uint64 chunkLiveBytes = 64 * MEM_BLOCK_SIZE - sizeof(struct __thread_mem_header_t);
+
+// A small object counts its slot, not the chunk the slot was carved from
+static const uint64 slotLiveBytes = USER_MEM_MIN_SLOT - sizeof(struct __user_mem_header_t);
+
+struct Point {
+    uint64 x, y;
+    Point(uint64 x, uint64 y) : x(x), y(y) {}
+};
+
+struct alignas(64) Line {
+    char bytes[64];
+};
+
+void Arena_test() {
+    uint64 baseline = Memory::liveBytes();
+
+    void *small = mem_alloc(8);
+
+    if (!small || Memory::liveBytes() - baseline != slotLiveBytes) {
+        printString("Small object not counted by its slot!\n");
+        return;
+    }
+
+    mem_free(small);
+
+    if (Memory::liveBytes() != baseline) {
+        printString("Freed small object still counted!\n");
+        return;
+    }
+
+    {
+        Arena arena;
+
+        if (!arena.alloc(0)) {
+            printString("Empty arena returned null for size 0!\n");
+            return;
+        }
+
+        if (Memory::liveBytes() - baseline != chunkLiveBytes || arena.allocated() != Arena::defaultChunkSize) {
+            printString("Default chunk does not fill whole blocks!\n");
+            return;
+        }
+
+        // Each of these wraps around somewhere without the checks
+        if (arena.alloc(~(size_t)0) || arena.alloc(~(size_t)0 - 100) || arena.alloc(16, (size_t)1 << 63)) {
+            printString("Arena handed out an allocation that wraps around!\n");
+            return;
+        }
+
+        for (int i = 0; i < objects; i++) {
+            Point *point = arena.create<Point>(i, 2 * i);
+            Line *line = arena.create<Line>();
+
+            if (!point || !line || point->x != (uint64)i || point->y != (uint64)(2 * i)) {
+                printString("Arena allocation failed!\n");
+                return;
+            }
+
+            if ((uint64)point % alignof(Point) || (uint64)line % alignof(Line)) {
+                printString("Arena allocation misaligned!\n");
+                return;
+            }
+        }
+
+        arena.reset();
+
+        if (Memory::liveBytes() - baseline != chunkLiveBytes || arena.allocated() != Arena::defaultChunkSize) {
+            printString("Reset did not keep just the first chunk!\n");
+            return;
+        }
+
+        if (!arena.alloc(0)) {
+            printString("Arena unusable after reset!\n");
+            return;
+        }
+    }
+
+    if (Memory::liveBytes() != baseline) {
+        printString("Arena leaked chunks!\n");
+        return;
+    }
+
+    printString("Arena allocations, reset and release work\n");
+}
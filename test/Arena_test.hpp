@@ -0,0 +1,6 @@
+#ifndef XV6_ARENA_TEST_HPP
+#define XV6_ARENA_TEST_HPP
+
+void Arena_test();
+
+#endif //XV6_ARENA_TEST_HPP
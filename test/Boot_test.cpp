@@ -0,0 +1,53 @@
+#include "../h/syscall_c.h"
+#include "Boot_test.hpp"
+
+#include "printing.hpp"
+
+// Heap index setup must not scale with RAM, only the boundary tags of the two runs in each heap get written.
+// The kernel counts every entry it stores, with MEM_COMPACT_INDEX a tag is a start and an alloc bit at both ends of the run
+#ifdef MEM_COMPACT_INDEX
+static const uint64 maxIndexWrites = 16;
+#else
+static const uint64 maxIndexWrites = 8;
+#endif
+
+// Writing a handful of tags takes nowhere near a millisecond, zeroing the whole index did
+static const uint64 maxMemInitTimeUs = 1000;
+
+void Boot_test() {
+    struct __boot_stats_t stats;
+
+    if (boot_stats(&stats)) {
+        printString("boot_stats failed\n");
+        return;
+    }
+
+    printString("Heap blocks: "); printInt(stats.heap_blocks); printString("\n");
+    printString("Index entries written by __mem_init: "); printInt(stats.mem_init_index_writes); printString("\n");
+    printString("__mem_init time [us]: "); printInt(stats.mem_init_time / CLINT_TICKS_PER_US); printString("\n");
+    printString("Boot to userMain [us]: "); printInt(stats.boot_time / CLINT_TICKS_PER_US); printString("\n");
+
+    uint64 heapBlocks = ((uint64)HEAP_END_ADDR - (uint64)HEAP_START_ADDR) / MEM_BLOCK_SIZE;
+
+    if (stats.heap_blocks != heapBlocks) {
+        printString("Heap block count does not match the heap, expected "); printInt(heapBlocks); printString("\n");
+        return;
+    }
+
+    if (stats.boot_time == 0 || stats.mem_init_time > stats.boot_time) {
+        printString("Boot times are inconsistent!\n");
+        return;
+    }
+
+    if (stats.mem_init_index_writes > maxIndexWrites) {
+        printString("Heap index init is proportional to heap size!\n");
+        return;
+    }
+
+    if (stats.mem_init_time / CLINT_TICKS_PER_US > maxMemInitTimeUs) {
+        printString("Heap index init took too long!\n");
+        return;
+    }
+
+    printString("Heap index init is constant time\n");
+}
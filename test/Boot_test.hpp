@@ -0,0 +1,6 @@
+#ifndef XV6_BOOT_TEST_HPP
+#define XV6_BOOT_TEST_HPP
+
+void Boot_test();
+
+#endif //XV6_BOOT_TEST_HPP
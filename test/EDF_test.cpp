@@ -0,0 +1,119 @@
+#include "../h/syscall_c.h"
+#include "EDF_test.hpp"
+
+#include "printing.hpp"
+
+static const int jobs = 3;
+static const time_t edfPeriod = 10;
+
+struct Result {
+    int start;
+    int misses;
+    int overruns;
+};
+
+static Result light, heavy, rejected, invalidBudget, invalidDeadline;
+static sem_t admitted, finished;
+
+// Only gets the processor while the EDF threads sleep, so a change means the heavy job was switched out
+static volatile uint64 background;
+static volatile bool stop;
+
+static void backgroundRun(void *) {
+    while (!stop) background++;
+}
+
+static void lightRun(void *) {
+    light.start = thread_edf_start(edfPeriod, 2, edfPeriod);
+    sem_signal(admitted);
+
+    for (int i = 0; i < jobs && light.start == 0; i++)
+        thread_period_wait();
+
+    light.misses = thread_edf_misses(0);
+    light.overruns = thread_period_overruns(0);
+    sem_signal(finished);
+}
+
+// Every job runs until its one tick budget is gone and then finishes on the next release
+static void heavyRun(void *) {
+    heavy.start = thread_edf_start(edfPeriod, 1, edfPeriod);
+    sem_signal(admitted);
+
+    for (int i = 0; i < jobs && heavy.start == 0; i++) {
+        uint64 seen = background;
+        while (background == seen) {}
+
+        thread_period_wait();
+    }
+
+    heavy.misses = thread_edf_misses(0);
+    heavy.overruns = thread_period_overruns(0);
+    sem_signal(finished);
+}
+
+static void rejectedRun(void *) {
+    invalidBudget.start = thread_edf_start(edfPeriod, 0, edfPeriod);
+    invalidDeadline.start = thread_edf_start(edfPeriod, 4, 2);
+
+    // Together with the two admitted threads this is more than the whole processor
+    rejected.start = thread_edf_start(edfPeriod, 8, edfPeriod);
+    sem_signal(finished);
+}
+
+static void printResult(const char *name, Result &result) {
+    printString(name); printString(": start "); printInt(result.start, 10, 1);
+    printString(", misses "); printInt(result.misses);
+    printString(", overruns "); printInt(result.overruns); printString("\n");
+}
+
+void EDF_test() {
+    thread_t threads[4];
+
+    sem_open(&admitted, 0);
+    sem_open(&finished, 0);
+
+    thread_create(&threads[0], backgroundRun, 0);
+    thread_create(&threads[1], lightRun, 0);
+    thread_create(&threads[2], heavyRun, 0);
+
+    sem_wait(admitted);
+    sem_wait(admitted);
+
+    thread_create(&threads[3], rejectedRun, 0);
+
+    for (int i = 0; i < 3; i++)
+        sem_wait(finished);
+
+    stop = true;
+
+    sem_close(admitted);
+    sem_close(finished);
+
+    printResult("Light", light);
+    printResult("Heavy", heavy);
+    printResult("Over capacity", rejected);
+
+    if (invalidBudget.start != -1 || invalidDeadline.start != -1) {
+        printString("Invalid EDF parameters were accepted!\n");
+        return;
+    }
+
+    if (light.start != 0 || heavy.start != 0 || rejected.start != -2) {
+        printString("Admission test let the processor be overbooked!\n");
+        return;
+    }
+
+    if (light.misses != 0 || light.overruns != 0) {
+        printString("A job within its budget missed its deadline!\n");
+        return;
+    }
+
+    // Each heavy job misses once and eats into the next release
+    if (heavy.misses != jobs || heavy.overruns < jobs) {
+        printString("Budget overruns were not counted!\n");
+        return;
+    }
+
+    printString("EDF admission and miss accounting hold\n");
+}
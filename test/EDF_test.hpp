@@ -0,0 +1,6 @@
+#ifndef XV6_EDF_TEST_HPP
+#define XV6_EDF_TEST_HPP
+
+void EDF_test();
+
+#endif //XV6_EDF_TEST_HPP
@@ -0,0 +1,133 @@
+#include "../h/syscall_c.h"
+#include "../h/user_mem.h"
+#include "Fragmentation_test.hpp"
+
+#include "printing.hpp"
+
+// Threads come up one after another, each stack allocated amid a burst of short lived small blocks, a few of which survive.
+// Then the threads exit and their stacks go back while the survivors stay
+static const int threads = 64;
+static const int burstMax = 64;
+static const int survivorRate = 16;
+static const int survivorSlots = 1024;
+static const uint64 stackBlocks = DEFAULT_STACK_SIZE / MEM_BLOCK_SIZE;
+
+// The rest of the user heap is held by one ballast allocation, an untouched tail would hide any fragmentation
+static const uint64 workBlocks = (1 << 20) / MEM_BLOCK_SIZE;
+
+// Largest free run may not fall below this share of all free memory while the threads come up
+static const uint64 minLargestPercent = 50;
+
+static void *stacks[threads];
+static void *survivors[survivorSlots];
+static void *burst[burstMax];
+
+static uint64 seed;
+
+// Bytes that together with the kernel's header fill exactly nblocks
+static uint64 blockBytes(uint64 nblocks) {
+    return nblocks * MEM_BLOCK_SIZE - sizeof(struct __thread_mem_header_t);
+}
+
+static uint64 nextRandom() {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+}
+
+static uint64 largestPercent() {
+    struct __mem_stats_t stats;
+    mem_stats(&stats, MEM_HEAP_USER);
+
+    uint64 freeBytes = stats.bytes_total - stats.bytes_in_use - stats.bytes_pooled;
+
+    return freeBytes ? stats.largest_free_run * 100 / freeBytes : 0;
+}
+
+// Runs the same workload every time. minPercent is the smallest share of free memory the largest free run held
+// while the threads came up, exitPercent the share it holds once their stacks are gone
+static int runWorkload(const char *name, uint64 *minPercent, uint64 *exitPercent) {
+    struct __mem_stats_t stats;
+    int survivorCount = 0;
+
+    seed = 1;
+    *minPercent = 100;
+
+    mem_stats(&stats, MEM_HEAP_USER);
+
+    if (stats.largest_free_run / MEM_BLOCK_SIZE <= workBlocks) {
+        printString("User heap too small for the workload!\n");
+        return -1;
+    }
+
+    void *ballast = mem_alloc_raw(blockBytes(stats.largest_free_run / MEM_BLOCK_SIZE - workBlocks));
+
+    if (!ballast) {
+        printString("Ballast allocation failed!\n");
+        return -1;
+    }
+
+    for (int thread = 0; thread < threads; thread++) {
+        int n = 1 + nextRandom() % burstMax;
+
+        for (int i = 0; i < n; i++)
+            burst[i] = mem_alloc_raw(blockBytes(1 + nextRandom() % 4));
+
+        stacks[thread] = mem_alloc_raw(blockBytes(stackBlocks));
+
+        for (int i = 0; i < n; i++) {
+            if (!burst[i]) continue;
+
+            if (nextRandom() % survivorRate == 0 && survivorCount < survivorSlots)
+                survivors[survivorCount++] = burst[i];
+            else
+                mem_free_raw(burst[i]);
+        }
+
+        uint64 percent = largestPercent();
+        if (percent < *minPercent) *minPercent = percent;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        if (stacks[i]) mem_free_raw(stacks[i]);
+        stacks[i] = 0;
+    }
+
+    *exitPercent = largestPercent();
+
+    for (int i = 0; i < survivorCount; i++)
+        mem_free_raw(survivors[i]);
+
+    mem_free_raw(ballast);
+
+    printString(name);
+    printString(": largest free run at least "); printInt(*minPercent);
+    printString("% of free memory, "); printInt(*exitPercent); printString("% after the threads exit\n");
+
+    return 0;
+}
+
+void Fragmentation_test() {
+    uint64 splitMin, splitExit, bottomMin, bottomExit;
+
+    if (runWorkload("Large allocations from the top", &splitMin, &splitExit)) return;
+
+    // Nothing is ever large enough to go to the top
+    size_t threshold = mem_large_threshold(~0ULL);
+    int failed = runWorkload("Everything from the bottom", &bottomMin, &bottomExit);
+    mem_large_threshold(threshold);
+
+    if (failed) return;
+
+    if (splitMin < minLargestPercent) {
+        printString("Heap fragmented under mixed workload!\n");
+        return;
+    }
+
+    // Stacks freed from the top coalesce, from the bottom they leave holes between the survivors
+    if (splitExit <= bottomExit) {
+        printString("Top placement did not keep stacks apart from small blocks!\n");
+        return;
+    }
+
+    printString("Top placement kept the heap in one piece\n");
+}
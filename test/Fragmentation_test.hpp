@@ -0,0 +1,6 @@
+#ifndef XV6_FRAGMENTATION_TEST_HPP
+#define XV6_FRAGMENTATION_TEST_HPP
+
+void Fragmentation_test();
+
+#endif //XV6_FRAGMENTATION_TEST_HPP
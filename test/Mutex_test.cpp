@@ -0,0 +1,154 @@
+#include "../h/syscall_cpp.hpp"
+#include "Mutex_test.hpp"
+
+#include "printing.hpp"
+
+static const int workers = 4;
+static const int increments = 500;
+
+// The low priority owner needs far less work than the middle one spins for
+static const uint64 ownerWork = 1000000;
+static const uint64 middleSpin = 200000000;
+
+static Mutex *counterMutex;
+static volatile int counter;
+
+static sem_t mutex, done, locked, release;
+static volatile bool highGotLock;
+static volatile bool middleGaveUp;
+static volatile int foreignUnlock;
+
+// Gives the processor away inside the critical section so every worker gets to wait on the mutex
+static void workerRun(void *) {
+    for (int i = 0; i < increments; i++) {
+        counterMutex->lock();
+        int value = counter;
+        thread_dispatch();
+        counter = value + 1;
+        counterMutex->unlock();
+    }
+
+    sem_signal(done);
+}
+
+static void holderRun(void *) {
+    sem_wait(mutex);
+    sem_signal(locked);
+    sem_wait(release);
+    sem_signal(mutex);
+    sem_signal(done);
+}
+
+static void quitterRun(void *) {
+    sem_wait(mutex);
+    sem_signal(done);
+}
+
+static void highRun(void *) {
+    sem_wait(mutex);
+    highGotLock = true;
+    sem_signal(mutex);
+    sem_signal(done);
+}
+
+static void lowRun(void *) {
+    sem_wait(mutex);
+    sem_signal(locked);
+
+    for (volatile uint64 i = 0; i < ownerWork; i++) {}
+
+    sem_signal(mutex);
+    sem_signal(done);
+}
+
+static void createWithPriority(thread_t *handle, void (*body)(void *), unsigned priority) {
+    struct __thread_attr_t attr = {};
+    attr.priority = priority;
+    thread_create_ex(handle, body, 0, &attr);
+}
+
+// Starts the high priority thread and then keeps the processor away from anything below it
+static void middleRun(void *) {
+    thread_t high;
+    createWithPriority(&high, highRun, 6);
+
+    volatile uint64 i = 0;
+    while (!highGotLock && i < middleSpin) i++;
+
+    middleGaveUp = !highGotLock;
+    sem_signal(done);
+}
+
+void Mutex_test() {
+    thread_t threads[workers];
+
+    counterMutex = new Mutex();
+    sem_open(&done, 0);
+    sem_open(&locked, 0);
+    sem_open(&release, 0);
+
+    for (int i = 0; i < workers; i++)
+        thread_create(&threads[i], workerRun, 0);
+
+    for (int i = 0; i < workers; i++)
+        sem_wait(done);
+
+    delete counterMutex;
+
+    printString("Counter: "); printInt(counter); printString("\n");
+
+    // Only the owner may unlock
+    mutex_open(&mutex);
+    thread_create(&threads[0], holderRun, 0);
+    sem_wait(locked);
+    foreignUnlock = sem_signal(mutex);
+    sem_signal(release);
+    sem_wait(done);
+
+    // An owner that exits hands the mutex on instead of leaving it locked
+    thread_create(&threads[0], quitterRun, 0);
+    sem_wait(done);
+    int abandoned = sem_timed_wait(mutex, 50);
+    if (abandoned == 0) sem_signal(mutex);
+
+    // Low takes the mutex, middle outranks it and high waits for it. Staying on top keeps low from finishing
+    // before middle is started
+    int ownPriority = thread_get_priority(0);
+    thread_set_priority(0, THREAD_PRIORITY_LEVELS - 1);
+
+    createWithPriority(&threads[0], lowRun, 1);
+    sem_wait(locked);
+    createWithPriority(&threads[1], middleRun, 3);
+
+    for (int i = 0; i < 3; i++)
+        sem_wait(done);
+
+    thread_set_priority(0, ownPriority);
+
+    sem_close(mutex);
+    sem_close(done);
+    sem_close(locked);
+    sem_close(release);
+
+    if (counter != workers * increments) {
+        printString("Mutex let two threads in at once!\n");
+        return;
+    }
+
+    if (foreignUnlock != -2) {
+        printString("A thread unlocked a mutex it did not own!\n");
+        return;
+    }
+
+    if (abandoned != 0) {
+        printString("Mutex stayed locked after its owner exited!\n");
+        return;
+    }
+
+    if (middleGaveUp) {
+        printString("Owner did not inherit the priority of its waiter!\n");
+        return;
+    }
+
+    printString("Mutex exclusion, ownership and inheritance hold\n");
+}
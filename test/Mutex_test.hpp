@@ -0,0 +1,6 @@
+#ifndef XV6_MUTEX_TEST_HPP
+#define XV6_MUTEX_TEST_HPP
+
+void Mutex_test();
+
+#endif //XV6_MUTEX_TEST_HPP
@@ -0,0 +1,119 @@
+#include "../h/syscall_cpp.hpp"
+#include "ObjectPool_test.hpp"
+
+#include "printing.hpp"
+
+static const int fixedSlots = 4;
+
+// More than one chunk of the shared pool, default chunks hold 32
+static const int messages = 100;
+
+static int destroyed;
+
+struct Point {
+    uint64 x, y;
+    Point(uint64 x, uint64 y) : x(x), y(y) {}
+};
+
+struct Message : public PoolAllocated<Message> {
+    uint64 id;
+    uint64 payload[3];
+
+    explicit Message(uint64 id) : id(id) {}
+    ~Message() { destroyed++; }
+};
+
+// Different size, goes through the global operators
+struct LongMessage : public Message {
+    uint64 extra[8];
+
+    LongMessage() : Message(0) {}
+};
+
+static_assert(noexcept(Message::operator new(sizeof(Message))), "a null from the pool must reach the new expression");
+
+static Message *sent[messages];
+
+void ObjectPool_test() {
+    ObjectPool<Point> fixed(fixedSlots, false);
+    Point *points[fixedSlots];
+
+    for (int i = 0; i < fixedSlots; i++) {
+        points[i] = fixed.create(i, 2 * i);
+
+        if (!points[i] || points[i]->y != (uint64)(2 * i) || (uint64)points[i] % alignof(Point)) {
+            printString("Fixed pool allocation failed!\n");
+            return;
+        }
+    }
+
+    if (fixed.create(0, 0)) {
+        printString("Fixed pool grew past its first chunk!\n");
+        return;
+    }
+
+    fixed.destroy(points[0]);
+    points[0] = fixed.create(7, 7);
+
+    if (!points[0] || fixed.objectsInUse() != fixedSlots) {
+        printString("Freed slot was not reused!\n");
+        return;
+    }
+
+    if (fixed.release() != -1) {
+        printString("Pool released chunks with objects still in use!\n");
+        return;
+    }
+
+    for (int i = 0; i < fixedSlots; i++)
+        fixed.destroy(points[i]);
+
+    if (fixed.release()) {
+        printString("Empty pool did not release its chunks!\n");
+        return;
+    }
+
+    for (int i = 0; i < messages; i++) {
+        sent[i] = new Message(i);
+
+        if (!sent[i]) {
+            printString("Pool allocated new failed!\n");
+            return;
+        }
+    }
+
+    if (Message::pool.objectsInUse() != messages) {
+        printString("Message objects did not come from the pool!\n");
+        return;
+    }
+
+    for (int i = 0; i < messages; i++) {
+        if (sent[i]->id != (uint64)i) {
+            printString("Pool allocated objects overlap!\n");
+            return;
+        }
+
+        delete sent[i];
+    }
+
+    LongMessage *longMessage = new LongMessage();
+
+    if (!longMessage || Message::pool.objectsInUse() != 0) {
+        printString("Subclass of a different size went to the pool!\n");
+        return;
+    }
+
+    delete longMessage;
+
+    if (destroyed != messages + 1) {
+        printString("Destructors did not run!\n");
+        return;
+    }
+
+    if (Message::pool.release()) {
+        printString("Shared pool did not release its chunks!\n");
+        return;
+    }
+
+    printString("Object pools hand out, reuse and release slots\n");
+}
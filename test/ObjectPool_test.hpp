@@ -0,0 +1,6 @@
+#ifndef XV6_OBJECTPOOL_TEST_HPP
+#define XV6_OBJECTPOOL_TEST_HPP
+
+void ObjectPool_test();
+
+#endif //XV6_OBJECTPOOL_TEST_HPP
@@ -0,0 +1,72 @@
+#include "../h/syscall_cpp.hpp"
+#include "Periodic_test.hpp"
+
+#include "printing.hpp"
+
+// Activations are counted over a fixed window, a release may fall on either edge of it
+static const time_t activationPeriod = 2;
+static const time_t window = 40;
+static const int slack = 1;
+
+class Counter : public PeriodicThread {
+public:
+    Counter() : PeriodicThread(activationPeriod), activations(0) {}
+
+    volatile int activations;
+
+protected:
+    void periodicActivation() override {
+        activations++;
+    }
+};
+
+void Periodic_test() {
+    Counter *counter = new Counter();
+    counter->start();
+
+    time_sleep(window);
+
+    int overruns = counter->overruns();
+    counter->terminate();
+
+    int seen = counter->activations;
+    printString("Activations in "); printInt(window); printString(" ticks: "); printInt(seen); printString("\n");
+    printString("Overruns: "); printInt(overruns); printString("\n");
+
+    // Stopped threads are not released again
+    time_sleep(4 * activationPeriod);
+    int after = counter->activations;
+
+    // Stopping right after start must not be lost whichever of the two threads runs first
+    Counter *early = new Counter();
+    early->start();
+    early->terminate();
+
+    time_sleep(4 * activationPeriod);
+    int earlySeen = early->activations;
+
+    delete counter;
+    delete early;
+
+    if (seen < (int)(window / activationPeriod) - slack || seen > (int)(window / activationPeriod) + slack) {
+        printString("Activations do not follow the period!\n");
+        return;
+    }
+
+    if (overruns != 0) {
+        printString("Short activations overran their period!\n");
+        return;
+    }
+
+    if (after != seen) {
+        printString("Thread kept running after terminate!\n");
+        return;
+    }
+
+    if (earlySeen > 1) {
+        printString("Terminate before the first release was lost!\n");
+        return;
+    }
+
+    printString("Periodic activations stayed on their period\n");
+}
@@ -0,0 +1,6 @@
+#ifndef XV6_PERIODIC_TEST_HPP
+#define XV6_PERIODIC_TEST_HPP
+
+void Periodic_test();
+
+#endif //XV6_PERIODIC_TEST_HPP
@@ -0,0 +1,134 @@
+#include "../h/syscall_c.h"
+#include "Timer_test.hpp"
+
+#include "printing.hpp"
+
+// Around the 64 slot turns of the first two wheel levels, everything past 64^4 ticks is out of range
+static const int sleepers = 7;
+static const time_t sleepTimes[sleepers] = {1, 3, 63, 64, 65, 128, 130};
+static const time_t outOfRange = 1ULL << 40;
+static const time_t longTimeout = 100;
+static const time_t shortTimeout = 10;
+static const uint64 slack = 2;
+
+// Sleeps one tick at a time on top of everything else, so it counts the ticks gone by
+static volatile uint64 ticks;
+static volatile bool stop;
+
+static volatile uint64 slept[sleepers];
+static volatile int farResult = 1, cancelResult = 1, timeoutResult = 1;
+static volatile uint64 cancelAt, timeoutTook;
+
+static sem_t done, far, cancel, never;
+
+static void tickerRun(void *) {
+    while (!stop) {
+        time_sleep(1);
+        ticks++;
+    }
+
+    sem_signal(done);
+}
+
+static void sleeperRun(void *arg) {
+    int i = (int)(uint64)arg;
+    uint64 start = ticks;
+
+    time_sleep(sleepTimes[i]);
+    slept[i] = ticks - start;
+
+    sem_signal(done);
+}
+
+static void farRun(void *) {
+    farResult = sem_timed_wait(far, outOfRange);
+    sem_signal(done);
+}
+
+// Signalled long before the timeout, the timer has to be gone or the next sleep could not arm one
+static void cancelRun(void *) {
+    cancelResult = sem_timed_wait(cancel, longTimeout);
+    cancelAt = ticks;
+    time_sleep(1);
+    sem_signal(done);
+}
+
+static void timeoutRun(void *) {
+    uint64 start = ticks;
+    timeoutResult = sem_timed_wait(never, shortTimeout);
+    timeoutTook = ticks - start;
+    sem_signal(done);
+}
+
+static void createWithPriority(void (*body)(void *), void *arg, unsigned priority) {
+    thread_t handle;
+    struct __thread_attr_t attr = {};
+    attr.priority = priority;
+    thread_create_ex(&handle, body, arg, &attr);
+}
+
+void Timer_test() {
+    sem_open(&done, 0);
+    sem_open(&far, 0);
+    sem_open(&cancel, 0);
+    sem_open(&never, 0);
+
+    createWithPriority(tickerRun, 0, THREAD_PRIORITY_LEVELS - 1);
+
+    for (int i = 0; i < sleepers; i++)
+        createWithPriority(sleeperRun, (void *)(uint64)i, THREAD_PRIORITY_LEVELS - 2);
+
+    createWithPriority(farRun, 0, THREAD_PRIORITY_LEVELS - 2);
+    createWithPriority(cancelRun, 0, THREAD_PRIORITY_LEVELS - 2);
+    createWithPriority(timeoutRun, 0, THREAD_PRIORITY_LEVELS - 2);
+
+    time_sleep(20);
+    uint64 signalledAt = ticks;
+    sem_signal(cancel);
+
+    for (int i = 0; i < sleepers + 2; i++)
+        sem_wait(done);
+
+    // By now the wheel cascaded a few times, none of which may release the out of range timeout
+    int farEarly = farResult;
+    sem_signal(far);
+    sem_wait(done);
+
+    stop = true;
+    sem_wait(done);
+
+    sem_close(done);
+    sem_close(far);
+    sem_close(cancel);
+    sem_close(never);
+
+    bool accurate = true;
+    for (int i = 0; i < sleepers; i++) {
+        printString("Sleep "); printInt(sleepTimes[i]); printString(" took "); printInt(slept[i]); printString("\n");
+
+        if (slept[i] + slack < sleepTimes[i] || slept[i] > sleepTimes[i] + slack)
+            accurate = false;
+    }
+
+    if (!accurate) {
+        printString("Sleeps did not last their time!\n");
+        return;
+    }
+
+    if (timeoutResult != -2 || timeoutTook + slack < shortTimeout || timeoutTook > shortTimeout + slack) {
+        printString("Timed wait did not time out on time!\n");
+        return;
+    }
+
+    if (cancelResult != 0 || cancelAt > signalledAt + slack) {
+        printString("Signalled timed wait was not woken!\n");
+        return;
+    }
+
+    if (farEarly != 1 || farResult != 0) {
+        printString("Out of range timeout fired early!\n");
+        return;
+    }
+
+    printString("Timer wheel kept every timeout\n");
+}
@@ -0,0 +1,6 @@
+#ifndef XV6_TIMER_TEST_HPP
+#define XV6_TIMER_TEST_HPP
+
+void Timer_test();
+
+#endif //XV6_TIMER_TEST_HPP
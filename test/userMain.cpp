@@ -28,13 +28,30 @@
 #include "../test/ConsumerProducer_CPP_API_test.hpp"
 #include "System_Mode_test.hpp"
 
+// TEST 8 (vreme podizanja sistema i inicijalizacija indeksa memorije)
+#include "../test/Boot_test.hpp"
+// TEST 9 (fragmentacija memorije pod mesovitim opterecenjem)
+#include "../test/Fragmentation_test.hpp"
+// TEST 10 (periodicne niti i zaustavljanje pre prvog izdanja)
+#include "../test/Periodic_test.hpp"
+// TEST 11 (EDF prijem zadataka i brojanje promasenih rokova)
+#include "../test/EDF_test.hpp"
+// TEST 12 (mutex, vlasnistvo i nasledjivanje prioriteta)
+#include "../test/Mutex_test.hpp"
+// TEST 13 (tajmeri, kaskade tocka i otkazivanje)
+#include "../test/Timer_test.hpp"
+// TEST 14 (arena alokator, prazna arena i prekoracenja)
+#include "../test/Arena_test.hpp"
+// TEST 15 (bazen objekata i PoolAllocated new/delete)
+#include "../test/ObjectPool_test.hpp"
+
 #endif
 
 extern "C" {
 void userMain() {
-    printString("Unesite broj testa? [1-7]\n");
-    int test = getc() - '0';
-    getc(); // Enter posle broja
+    printString("Unesite broj testa? [1-15]\n");
+    char buf[8];
+    int test = stringToInt(getString(buf, sizeof(buf)));
 
     // int test = 3;
 
@@ -52,7 +69,7 @@ void userMain() {
         }
     }
 
-    if (test >= 5 && test <= 6) {
+    if ((test >= 5 && test <= 6) || test >= 8) {
         if (LEVEL_4_IMPLEMENTED == 0) {
             printString("Nije navedeno da je zadatak 4 implementiran\n");
             return;
@@ -101,6 +118,54 @@ void userMain() {
             System_Mode_test();
             printString("Test se nije uspesno zavrsio\n");
             printString("TEST 7 (zadatak 2., testiranje da li se korisnicki kod izvrsava u korisnickom rezimu)\n");
+#endif
+            break;
+        case 8:
+#if LEVEL_4_IMPLEMENTED == 1
+            Boot_test();
+            printString("TEST 8 (vreme podizanja sistema i inicijalizacija indeksa memorije)\n");
+#endif
+            break;
+        case 9:
+#if LEVEL_4_IMPLEMENTED == 1
+            Fragmentation_test();
+            printString("TEST 9 (fragmentacija memorije pod mesovitim opterecenjem)\n");
+#endif
+            break;
+        case 10:
+#if LEVEL_4_IMPLEMENTED == 1
+            Periodic_test();
+            printString("TEST 10 (periodicne niti i zaustavljanje pre prvog izdanja)\n");
+#endif
+            break;
+        case 11:
+#if LEVEL_4_IMPLEMENTED == 1
+            EDF_test();
+            printString("TEST 11 (EDF prijem zadataka i brojanje promasenih rokova)\n");
+#endif
+            break;
+        case 12:
+#if LEVEL_4_IMPLEMENTED == 1
+            Mutex_test();
+            printString("TEST 12 (mutex, vlasnistvo i nasledjivanje prioriteta)\n");
+#endif
+            break;
+        case 13:
+#if LEVEL_4_IMPLEMENTED == 1
+            Timer_test();
+            printString("TEST 13 (tajmeri, kaskade tocka i otkazivanje)\n");
+#endif
+            break;
+        case 14:
+#if LEVEL_4_IMPLEMENTED == 1
+            Arena_test();
+            printString("TEST 14 (arena alokator, prazna arena i prekoracenja)\n");
+#endif
+            break;
+        case 15:
+#if LEVEL_4_IMPLEMENTED == 1
+            ObjectPool_test();
+            printString("TEST 15 (bazen objekata i PoolAllocated new/delete)\n");
 #endif
             break;
         default: